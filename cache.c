@@ -0,0 +1,191 @@
+/*
+  Module       : cache.c
+  Purpose      : Compressed in-memory cache of decoded images
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "qiv.h"
+#include "xmalloc.h"
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+/* When qiv moves away from an image, the decoded ARGB pixels are
+ * compressed with LZ4 and kept in memory (up to cache_mb MiB of compressed
+ * data, least recently used first out). Going back to the image then
+ * decompresses the pixels, which is much faster than decoding the JPEG
+ * again, especially from a slow filesystem.
+ */
+
+typedef struct _qiv_cache_entry {
+  struct _qiv_cache_entry *prev, *next;  /* Most recently used first. */
+  char *name;
+  time_t mtime;
+  off_t size;
+  gint w, h;
+  gboolean has_alpha;
+  int csize;  /* Size of the compressed pixels in data. */
+  char *data;
+} qiv_cache_entry;
+
+static qiv_cache_entry *cache_head, *cache_tail;
+static size_t cache_used;  /* Sum of csize of all entries. */
+static unsigned long cache_puts, cache_hits, cache_misses, cache_evictions;
+static double cache_raw_bytes, cache_compressed_bytes;  /* Of all puts. */
+static double cache_compress_secs, cache_decompress_secs;
+
+static double now_secs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1.0e6;
+}
+
+static qiv_cache_entry *cache_find(const char *name, const struct stat *st) {
+  qiv_cache_entry *e;
+  for (e = cache_head; e; e = e->next) {
+    if (e->mtime == st->st_mtime && e->size == st->st_size &&
+        0 == strcmp(e->name, name)) return e;
+  }
+  return NULL;
+}
+
+static void cache_unlink(qiv_cache_entry *e) {
+  if (e->prev) e->prev->next = e->next; else cache_head = e->next;
+  if (e->next) e->next->prev = e->prev; else cache_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void cache_push_front(qiv_cache_entry *e) {
+  e->prev = NULL;
+  e->next = cache_head;
+  if (cache_head) cache_head->prev = e; else cache_tail = e;
+  cache_head = e;
+}
+
+static void cache_free_entry(qiv_cache_entry *e) {
+  cache_unlink(e);
+  cache_used -= e->csize;
+  free(e->name);
+  free(e->data);
+  free(e);
+}
+
+/* Stores a compressed copy of the image in the Imlib2 context as the
+ * decoded pixels of name (with stat st). The pixels are stored after
+ * autorotation, autorotate doesn't change while qiv is running.
+ */
+void cache_put(const char *name, const struct stat *st)
+{
+#ifdef HAVE_LZ4
+  qiv_cache_entry *e;
+  const size_t budget = (size_t)cache_mb << 20;
+  size_t raw_size;
+  int bound, csize;
+  char *data;
+  double before;
+
+  if (cache_mb <= 0 || !imlib_context_get_image()) return;
+  if ((e = cache_find(name, st)) != NULL) {  /* Still there since the get. */
+    cache_unlink(e);
+    cache_push_front(e);
+    return;
+  }
+  raw_size = (size_t)imlib_image_get_width() * imlib_image_get_height() * sizeof(DATA32);
+  if (raw_size > LZ4_MAX_INPUT_SIZE) return;
+  before = now_secs();
+  bound = LZ4_compressBound((int)raw_size);
+  data = xmalloc(bound);
+  csize = LZ4_compress_default(
+      (const char*)imlib_image_get_data_for_reading_only(), data,
+      (int)raw_size, bound);
+  cache_compress_secs += now_secs() - before;
+  if (csize <= 0 || (size_t)csize > budget) {
+    free(data);
+    return;
+  }
+  e = (qiv_cache_entry*)xcalloc(1, sizeof *e);
+  e->name = strdup(name);
+  e->mtime = st->st_mtime;
+  e->size = st->st_size;
+  e->w = imlib_image_get_width();
+  e->h = imlib_image_get_height();
+  e->has_alpha = imlib_image_has_alpha();
+  e->csize = csize;
+  e->data = xrealloc(data, csize);
+  cache_push_front(e);
+  cache_used += csize;
+  ++cache_puts;
+  cache_raw_bytes += raw_size;
+  cache_compressed_bytes += csize;
+  while (cache_used > budget && cache_tail != e) {
+    cache_free_entry(cache_tail);
+    ++cache_evictions;
+  }
+#else
+  (void)name; (void)st;
+#endif
+}
+
+/* Returns a new Imlib2 image with the cached pixels of name, or NULL if
+ * not cached (or the file has changed since).
+ */
+Imlib_Image cache_get(const char *name, const struct stat *st)
+{
+#ifdef HAVE_LZ4
+  qiv_cache_entry *e;
+  Imlib_Image im;
+  DATA32 *pixels;
+  int raw_size;
+  double before;
+
+  if (cache_mb <= 0) return NULL;
+  if ((e = cache_find(name, st)) == NULL) {
+    ++cache_misses;
+    return NULL;
+  }
+  before = now_secs();
+  if ((im = imlib_create_image(e->w, e->h)) == NULL) return NULL;
+  imlib_context_set_image(im);
+  raw_size = e->w * e->h * sizeof(DATA32);
+  pixels = imlib_image_get_data();
+  if (LZ4_decompress_safe(e->data, (char*)pixels, e->csize, raw_size) != raw_size) {
+    imlib_image_put_back_data(pixels);
+    imlib_free_image();
+    cache_free_entry(e);
+    ++cache_misses;
+    return NULL;
+  }
+  imlib_image_put_back_data(pixels);
+  imlib_image_set_has_alpha(e->has_alpha);
+  cache_decompress_secs += now_secs() - before;
+  cache_unlink(e);
+  cache_push_front(e);
+  ++cache_hits;
+  return im;
+#else
+  (void)name; (void)st;
+  return NULL;
+#endif
+}
+
+void cache_print_stats(void)
+{
+  if (cache_mb <= 0) return;
+  g_print("cache: %lu hits, %lu misses, %lu puts, %lu evictions, %.1f MiB used\n",
+          cache_hits, cache_misses, cache_puts, cache_evictions,
+          cache_used / 1048576.0);
+  if (cache_puts) {
+    g_print("cache: compression ratio %.2f (%.1f MiB -> %.1f MiB), "
+            "%.3fs compressing, %.3fs decompressing\n",
+            cache_raw_bytes / cache_compressed_bytes,
+            cache_raw_bytes / 1048576.0, cache_compressed_bytes / 1048576.0,
+            cache_compress_secs, cache_decompress_secs);
+  }
+}
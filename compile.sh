@@ -1,6 +1,6 @@
 #! /bin/sh --
 # on Ubuntu Karmic
-# on Ubuntu Lucid: sudo apt-get install libimlib2-dev libmagic-dev
-# on Ubuntu Trusty: sudo apt-get install libexif-dev libmagic-dev libimlib2-dev libgtk2.0-dev
+# on Ubuntu Lucid: sudo apt-get install libimlib2-dev
+# on Ubuntu Trusty: sudo apt-get install libexif-dev libimlib2-dev libgtk2.0-dev
 
 make qiv
@@ -0,0 +1,402 @@
+/*
+  Module       : decoder.c
+  Purpose      : Pool of out-of-process image decoders
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  /* memfd_create(...) */
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* Imlib2 is not thread-safe, so parallel decoding is done in helper
+ * processes, each with its own Imlib2 context. A helper receives a
+ * filename on its socket, decodes the whole image, copies the ARGB pixels
+ * to a memfd, and passes the memfd back over the socket (SCM_RIGHTS). The
+ * pixels never travel through the socket itself.
+ *
+ * If a helper crashes on a corrupt file, only the helper dies: the image
+ * is reported as unloadable, and a new helper is started.
+ */
+
+typedef struct _qiv_decoder_reply {
+  gint w, h;  /* -1 if the image couldn't be loaded. */
+  gint has_alpha;
+} qiv_decoder_reply;
+
+typedef struct _qiv_decoder {
+  pid_t pid;        /* -1 if not running. */
+  int fd;           /* Socket to the helper process, -1 if not running. */
+  char *name;       /* File being decoded (or already decoded), NULL if idle. */
+  gboolean is_done; /* reply and pixels_fd are valid for name. */
+  int pixels_fd;    /* memfd with the ARGB pixels of name, or -1. */
+  qiv_decoder_reply reply;
+} qiv_decoder;
+
+static qiv_decoder *pool;
+
+static ssize_t read_full(int fd, void *buf, size_t size) {
+  size_t done = 0;
+  ssize_t got;
+  while (done < size) {
+    got = read(fd, (char*)buf + done, size - done);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) return done ? (ssize_t)done : got;
+    done += got;
+  }
+  return done;
+}
+
+static int create_pixels_fd(size_t size) {
+  int fd;
+#ifdef MFD_CLOEXEC
+  fd = memfd_create("qiv-pixels", MFD_CLOEXEC);
+#else
+  char shm_name[32];
+  snprintf(shm_name, sizeof shm_name, "/qiv-pixels-%d", (int)getpid());
+  fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd >= 0) shm_unlink(shm_name);
+#endif
+  if (fd >= 0 && ftruncate(fd, size) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/* Sends reply, and pixels_fd (if not -1) as ancillary data. */
+static int send_reply(int fd, const qiv_decoder_reply *reply, int pixels_fd) {
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = (void*)reply;
+  iov.iov_len = sizeof *reply;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (pixels_fd >= 0) {
+    struct cmsghdr *cmsg;
+    memset(&control, 0, sizeof control);
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pixels_fd, sizeof(int));
+  }
+  return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof *reply ? 0 : -1;
+}
+
+/* The main loop of a helper process. Never returns. */
+static void decoder_main(int fd) {
+  char *name = NULL;
+  guint32 len, name_size = 0;
+  qiv_decoder_reply reply;
+  Imlib_Image im;
+  int pixels_fd;
+
+  if (decoder_mem_limit > 0) {
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = (rlim_t)decoder_mem_limit << 20;
+    setrlimit(RLIMIT_AS, &rl);
+  }
+  imlib_set_cache_size(0);  /* Each image is decoded only once here. */
+
+  for (;;) {
+    if (read_full(fd, &len, sizeof len) != sizeof len) _exit(0);
+    if (len + 1 > name_size) name = xrealloc(name, name_size = len + 1);
+    if (read_full(fd, name, len) != (ssize_t)len) _exit(0);
+    name[len] = '\0';
+
+    reply.w = reply.h = -1;
+    reply.has_alpha = 0;
+    pixels_fd = -1;
+    if ((im = imlib_load_image_immediately(name)) != NULL) {
+      size_t size;
+      void *p;
+      imlib_context_set_image(im);
+      reply.w = imlib_image_get_width();
+      reply.h = imlib_image_get_height();
+      reply.has_alpha = imlib_image_has_alpha();
+      size = (size_t)reply.w * reply.h * sizeof(DATA32);
+      if ((pixels_fd = create_pixels_fd(size)) >= 0 &&
+          (p = mmap(NULL, size, PROT_WRITE, MAP_SHARED, pixels_fd, 0)) != MAP_FAILED) {
+        memcpy(p, imlib_image_get_data_for_reading_only(), size);
+        munmap(p, size);
+      } else {
+        reply.w = reply.h = -1;
+      }
+      imlib_free_image_and_decache();
+    }
+    if (send_reply(fd, &reply, reply.w >= 0 ? pixels_fd : -1) != 0) _exit(0);
+    if (pixels_fd >= 0) close(pixels_fd);
+  }
+}
+
+static gboolean decoder_spawn(qiv_decoder *d) {
+  int sv[2], i;
+  pid_t pid;
+
+  d->pid = -1;
+  d->fd = d->pixels_fd = -1;
+  d->name = NULL;
+  d->is_done = FALSE;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+    perror("qiv: socketpair");
+    return FALSE;
+  }
+  pid = fork();
+  if (pid < 0) {
+    perror("qiv: fork");
+    close(sv[0]);
+    close(sv[1]);
+    return FALSE;
+  }
+  if (pid == 0) {
+    /* Child. Don't keep the other helpers alive when the viewer exits. */
+    close(sv[0]);
+    for (i = 0; i < decoders; ++i) {
+      if (pool[i].fd >= 0) close(pool[i].fd);
+      if (pool[i].pixels_fd >= 0) close(pool[i].pixels_fd);
+    }
+    signal(SIGINT, SIG_IGN);
+    decoder_main(sv[1]);
+  }
+  close(sv[1]);
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  d->pid = pid;
+  d->fd = sv[0];
+  return TRUE;
+}
+
+static void decoder_reset(qiv_decoder *d) {
+  free(d->name);
+  d->name = NULL;
+  d->is_done = FALSE;
+  if (d->pixels_fd >= 0) {
+    close(d->pixels_fd);
+    d->pixels_fd = -1;
+  }
+}
+
+/* Called when the helper has died (or misbehaves). Starts a new one. */
+static void decoder_restart(qiv_decoder *d) {
+  int status;
+  if (d->name) {
+    fprintf(stderr, "qiv: decoder process %d died while loading %s\n",
+            (int)d->pid, d->name);
+  }
+  decoder_reset(d);
+  if (d->fd >= 0) close(d->fd);
+  if (d->pid > 0) {  /* Not reaped yet. */
+    kill(d->pid, SIGKILL);
+    waitpid(d->pid, &status, 0);
+  }
+  decoder_spawn(d);
+}
+
+static int decoder_send(qiv_decoder *d, const char *name) {
+  guint32 len = strlen(name);
+  struct iovec iov[2];
+  struct msghdr msg;
+
+  if (d->fd < 0 && !decoder_spawn(d)) return -1;
+  d->name = strdup(name);
+  memset(&msg, 0, sizeof msg);
+  iov[0].iov_base = &len;
+  iov[0].iov_len = sizeof len;
+  iov[1].iov_base = (void*)name;
+  iov[1].iov_len = len;
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (sendmsg(d->fd, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof len + len)) {
+    decoder_restart(d);
+    return -1;
+  }
+  return 0;
+}
+
+/* Blocks until the reply for d->name arrives. Returns 0 on success. */
+static int decoder_receive(qiv_decoder *d) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  ssize_t got;
+
+  if (d->is_done) return 0;
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = &d->reply;
+  iov.iov_len = sizeof d->reply;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+  do {
+    got = recvmsg(d->fd, &msg, MSG_CMSG_CLOEXEC);
+  } while (got < 0 && errno == EINTR);
+  if (got > 0 && got < (ssize_t)sizeof d->reply &&
+      read_full(d->fd, (char*)&d->reply + got, sizeof d->reply - got) > 0) {
+    got = sizeof d->reply;
+  }
+  if (got != (ssize_t)sizeof d->reply) {
+    decoder_restart(d);  /* Crashed, probably on a corrupt file. */
+    return -1;
+  }
+  d->pixels_fd = -1;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&d->pixels_fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+  }
+  d->is_done = TRUE;
+  return 0;
+}
+
+/* Returns TRUE if the reply of d can be read without blocking. */
+static gboolean decoder_is_ready(qiv_decoder *d) {
+  fd_set rfds;
+  struct timeval tv = {0, 0};
+  if (d->is_done) return TRUE;
+  FD_ZERO(&rfds);
+  FD_SET(d->fd, &rfds);
+  return select(d->fd + 1, &rfds, NULL, NULL, &tv) > 0;
+}
+
+/* Makes an Imlib2 image of the pixels received by d, and makes d idle. */
+static Imlib_Image decoder_take_image(qiv_decoder *d) {
+  Imlib_Image im = NULL;
+  if (d->reply.w > 0 && d->reply.h > 0 && d->pixels_fd >= 0) {
+    const size_t size = (size_t)d->reply.w * d->reply.h * sizeof(DATA32);
+    void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, d->pixels_fd, 0);
+    if (p != MAP_FAILED) {
+      /* Imlib2 may free(...) the pixel buffer of an image when rotating, so
+       * it must own a malloc(...)ed copy.
+       */
+      if ((im = imlib_create_image_using_copied_data(
+          d->reply.w, d->reply.h, (DATA32*)p)) != NULL) {
+        imlib_context_set_image(im);
+        imlib_image_set_has_alpha(d->reply.has_alpha);
+      }
+      munmap(p, size);
+    }
+  }
+  decoder_reset(d);
+  return im;
+}
+
+void decoder_pool_start(void)
+{
+  int i;
+  if (decoders <= 0 || pool) return;
+  pool = (qiv_decoder*)xcalloc(decoders, sizeof *pool);
+  for (i = 0; i < decoders; ++i) {
+    pool[i].pid = -1;
+    pool[i].fd = pool[i].pixels_fd = -1;
+  }
+  for (i = 0; i < decoders; ++i) decoder_spawn(&pool[i]);
+}
+
+static gboolean is_name_in(const char *name, const char *const *names, int count) {
+  int i;
+  for (i = 0; i < count; ++i) {
+    if (0 == strcmp(name, names[i])) return TRUE;
+  }
+  return FALSE;
+}
+
+/* Returns an idle decoder, discarding a finished prefetch (not of
+ * keep_names[0..keep_count)) if needed.
+ */
+static qiv_decoder *decoder_find_idle(gboolean is_prefetch, const char *const *keep_names, int keep_count) {
+  int i, busy = 0;
+  for (i = 0; i < decoders; ++i) {
+    if (pool[i].name) ++busy;
+  }
+  /* Keep one decoder free for the image the user asks for. */
+  if (is_prefetch && busy >= decoders - 1) {
+    for (i = 0; i < decoders; ++i) {
+      if (pool[i].name && !is_name_in(pool[i].name, keep_names, keep_count) &&
+          decoder_is_ready(&pool[i]) && decoder_receive(&pool[i]) == 0) {
+        decoder_reset(&pool[i]);
+        return &pool[i];
+      }
+    }
+    return NULL;
+  }
+  for (i = 0; i < decoders; ++i) {
+    if (!pool[i].name) return &pool[i];
+  }
+  return NULL;
+}
+
+static qiv_decoder *decoder_find(const char *name) {
+  int i;
+  for (i = 0; i < decoders; ++i) {
+    if (pool[i].name && 0 == strcmp(pool[i].name, name)) return &pool[i];
+  }
+  return NULL;
+}
+
+/* Loads the image file name, fully decoded. Returns NULL on error. Uses
+ * the decoder pool if enabled (--decoders), otherwise Imlib2 directly.
+ */
+Imlib_Image decoder_load_image(const char *name)
+{
+  qiv_decoder *d;
+
+  if (!pool) return imlib_load_image(name);
+  if ((d = decoder_find(name)) == NULL) {
+    if ((d = decoder_find_idle(FALSE, NULL, 0)) == NULL) {
+      /* All busy with prefetches: wait for the first one, drop its result. */
+      d = &pool[0];
+      if (decoder_receive(d) == 0) decoder_reset(d);
+    }
+    if (decoder_send(d, name) != 0) return NULL;
+  }
+  if (decoder_receive(d) != 0) return NULL;
+  return decoder_take_image(d);
+}
+
+/* Starts decoding names[0..count) (the most wanted first) in the
+ * background, as long as there are idle decoders, or ones with finished
+ * prefetches of other images. Returns the number of names (from the
+ * first) being decoded or already decoded.
+ */
+int decoder_prefetch(const char *const *names, int count)
+{
+  qiv_decoder *d;
+  int i;
+  if (!pool || decoders < 2) return 0;
+  for (i = 0; i < count; ++i) {
+    if (decoder_find(names[i])) continue;
+    if ((d = decoder_find_idle(TRUE, names, count)) == NULL ||
+        decoder_send(d, names[i]) != 0) break;
+  }
+  return i;
+}
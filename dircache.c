@@ -0,0 +1,217 @@
+/*
+  Module       : dircache.c
+  Purpose      : Per-directory cache of file names for thumbnail lookups
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* With --thumbnail, qiv looks for foo.th.jpg next to each image foo.jpg.
+ * Most of these lookups fail, and each failed stat() is a round trip on
+ * NFS or sshfs. Instead, qiv reads each directory once, and keeps the set
+ * of *.th.jpg names in it, so the lookup becomes a hash table probe. The
+ * set is read again if the mtime of the directory changes, which is
+ * checked at most every DIRCACHE_REVALIDATE_SECS seconds (so a new
+ * thumbnail may be noticed that much later).
+ *
+ * The same directory listing also answers readlink() for git-annex
+ * symlinks (../.git/annex/objects/...): names which aren't symlinks need
+ * no syscall, and symlink targets are read on first use and remembered
+ * until the directory changes. (Resolving all symlinks of a directory at
+ * once would make opening a single image of a large annex slow.) The
+ * object directories themselves are not cached, each contains one file.
+ */
+
+#define DIRCACHE_REVALIDATE_SECS 2
+
+typedef struct {
+  time_t mtime;  /* Of the directory when it was read. */
+  time_t checked_at;  /* When mtime was last compared. */
+  gboolean is_readable;
+  GHashTable *thumbnails;  /* Basenames of *.th.jpg files. */
+  /* Basename -> not_link, link_unresolved or the symlink target. */
+  GHashTable *names;
+} qiv_dir_entry;
+
+static char not_link[] = "", link_unresolved[] = "";
+
+static GHashTable *dirs;  /* Directory name -> qiv_dir_entry*. */
+static unsigned long dircache_lookups, dircache_scans, dircache_fallbacks;
+/* Syscalls made by this file, and the ones answered from the cache. */
+static unsigned long syscalls_made, syscalls_saved;
+
+static void free_name_value(gpointer value) {
+  if (value != not_link && value != link_unresolved) g_free(value);
+}
+
+static gboolean is_th_jpg(const char *name) {
+  size_t len = strlen(name);
+  return len > 7 && 0 == strcmp(name + len - 7, ".th.jpg");
+}
+
+/* (Re)reads the names and *.th.jpg names of dirname to e. */
+static void scan_dir(const char *dirname, qiv_dir_entry *e) {
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  char *name;
+  unsigned char d_type;
+
+  ++dircache_scans;
+  g_hash_table_remove_all(e->thumbnails);
+  g_hash_table_remove_all(e->names);
+  e->is_readable = FALSE;
+  syscalls_made += 2;
+  if (stat(dirname, &st) != 0 || (d = opendir(dirname)) == NULL) return;
+  e->mtime = st.st_mtime;
+  e->is_readable = TRUE;
+  syscalls_made += 2;  /* At least one getdents() and close(). */
+  while ((de = readdir(d)) != NULL) {
+    d_type = de->d_type;
+    if (d_type == DT_UNKNOWN) {  /* Some filesystems don't fill d_type. */
+      name = g_strdup_printf("%s/%s", dirname, de->d_name);
+      ++syscalls_made;
+      d_type = lstat(name, &st) == 0 && S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+      g_free(name);
+    }
+    g_hash_table_insert(e->names, g_strdup(de->d_name),
+                        d_type == DT_LNK ? link_unresolved : not_link);
+    if (!is_th_jpg(de->d_name)) continue;
+    if (d_type != DT_REG) {  /* Symlink or special, check the target. */
+      name = g_strdup_printf("%s/%s", dirname, de->d_name);
+      ++syscalls_made;
+      if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+        g_free(name);
+        continue;
+      }
+      g_free(name);
+    }
+    g_hash_table_insert(e->thumbnails, g_strdup(de->d_name), NULL);
+  }
+  closedir(d);
+}
+
+/* Returns the entry of dirname, read or revalidated if needed. */
+static qiv_dir_entry *get_dir_entry(const char *dirname) {
+  qiv_dir_entry *e;
+  time_t now = time(NULL);
+  struct stat st;
+
+  if (!dirs) dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  if ((e = g_hash_table_lookup(dirs, dirname)) == NULL) {
+    e = (qiv_dir_entry*)xcalloc(1, sizeof *e);
+    e->thumbnails = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    e->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_name_value);
+    g_hash_table_insert(dirs, g_strdup(dirname), e);
+    scan_dir(dirname, e);
+    e->checked_at = now;
+  } else if (now - e->checked_at >= DIRCACHE_REVALIDATE_SECS) {
+    e->checked_at = now;
+    ++syscalls_made;
+    if (stat(dirname, &st) != 0 || !e->is_readable || st.st_mtime != e->mtime) {
+      scan_dir(dirname, e);
+    }
+  }
+  return e;
+}
+
+/* Returns the entry of the directory containing path, and sets *slash_out
+ * to the last '/' in path (or NULL).
+ */
+static qiv_dir_entry *get_parent_entry(const char *path, const char **slash_out) {
+  const char *slash = strrchr(path, '/');
+  char *dirname = slash ? g_strndup(path, slash == path ? 1 : slash - path)
+                        : g_strdup(".");
+  qiv_dir_entry *e = get_dir_entry(dirname);
+  g_free(dirname);
+  *slash_out = slash;
+  return e;
+}
+
+/* Returns TRUE if th_filename (a *.th.jpg file name) is a regular file (or
+ * a symlink to one).
+ */
+gboolean dircache_has_thumbnail(const char *th_filename)
+{
+  const char *slash;
+  qiv_dir_entry *e;
+  gboolean result;
+  struct stat st;
+
+  ++dircache_lookups;
+  if (strstr(th_filename, ".git/annex/objects/")) {
+    /* Each git-annex object has its own directory, reading it is slower. */
+    ++syscalls_made;
+    return stat(th_filename, &st) == 0 && S_ISREG(st.st_mode);
+  }
+  e = get_parent_entry(th_filename, &slash);
+  if (!e->is_readable) {  /* For example, not listable (mode 0711). */
+    ++dircache_fallbacks;
+    ++syscalls_made;
+    return stat(th_filename, &st) == 0 && S_ISREG(st.st_mode);
+  }
+  ++syscalls_saved;
+  result = g_hash_table_lookup_extended(
+      e->thumbnails, slash ? slash + 1 : th_filename, NULL, NULL);
+  return result;
+}
+
+/* The same as readlink(), but answered from the cache of the directory of
+ * path if possible.
+ */
+ssize_t dircache_readlink(const char *path, char *buf, size_t size)
+{
+  const char *slash;
+  qiv_dir_entry *e = get_parent_entry(path, &slash);
+  const char *basename = slash ? slash + 1 : path;
+  char *value, link_target[PATH_MAX];
+  ssize_t len;
+
+  value = e->is_readable && *basename != '\0' ?
+      g_hash_table_lookup(e->names, basename) : NULL;
+  if (!value) {  /* Unlistable directory, or a name created recently. */
+    ++syscalls_made;
+    return readlink(path, buf, size);
+  } else if (value == not_link) {
+    ++syscalls_saved;
+    errno = EINVAL;
+    return -1;
+  } else if (value == link_unresolved) {
+    ++syscalls_made;
+    if ((len = readlink(path, link_target, sizeof(link_target) - 1)) < 0) return len;
+    link_target[len] = '\0';
+    value = g_strdup(link_target);
+    g_hash_table_insert(e->names, g_strdup(basename), value);
+  } else {
+    ++syscalls_saved;
+  }
+  len = strlen(value);
+  if ((size_t)len > size) len = size;  /* Truncate like readlink(). */
+  memcpy(buf, value, len);
+  return len;
+}
+
+void dircache_print_stats(void)
+{
+  if (!dircache_scans) return;
+  g_print("dircache: %lu thumbnail lookups, %lu directory scans, %lu stat fallbacks\n",
+          dircache_lookups, dircache_scans, dircache_fallbacks);
+  g_print("dircache: %lu syscalls made, %lu answered from the cache "
+          "(%.2f instead of %.2f syscalls per thumbnail lookup)\n",
+          syscalls_made, syscalls_saved,
+          dircache_lookups ? (double)syscalls_made / dircache_lookups : 0.0,
+          dircache_lookups ? (double)(syscalls_made + syscalls_saved) / dircache_lookups : 0.0);
+}
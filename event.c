@@ -853,6 +853,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
               if(magnify && !fullscreen)    gdk_window_hide(magnify_img.win); // [lc]
               qiv_load_image(q);
             } else {
+              load_full_resolution(q);
               check_size(q, TRUE);
               update_image(q, REDRAW);
             }
@@ -1101,6 +1102,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
             q->infotext = (scale_down ?
                      "(Scale down: on)" : "(Scale down: off)");
             zoom_factor = maxpect ? 0 : fixed_zoom_factor;  /* reset zoom */
+            load_full_resolution(q);
             check_size(q, TRUE);
             update_image(q, REDRAW);
             break;
@@ -1312,6 +1314,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
 
           case 'h':
             imlib_image_flip_horizontal();
+            q->is_cacheable = FALSE;
             q->infotext = ("(Flipped horizontally)");
             update_image(q, REDRAW);
             break;
@@ -1320,6 +1323,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
 
           case 'v':
             imlib_image_flip_vertical();
+            q->is_cacheable = FALSE;
             q->infotext = ("(Flipped vertically)");
             update_image(q, REDRAW);
             break;
@@ -1332,7 +1336,9 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
                      "(File watching: on)" : "(File watching: off)");
             update_image(q, REDRAW);
             if(watch_file){
-              g_idle_add (qiv_watch_file, q);
+              watch_file_update(q);
+            } else {
+              watch_file_stop();
             }
             break;
 
@@ -1340,6 +1346,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
 
           case 'k':
             imlib_image_orientate(1);
+            q->is_cacheable = FALSE;
             q->infotext = ("(Rotated right)");
             swap(&q->orig_w, &q->orig_h);
             swap(&q->win_w, &q->win_h);
@@ -1352,6 +1359,7 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
 
           case 'l':
             imlib_image_orientate(3);
+            q->is_cacheable = FALSE;
             q->infotext = ("(Rotated left)");
             swap(&q->orig_w, &q->orig_h);
             swap(&q->win_w, &q->win_h);
@@ -1515,5 +1523,6 @@ void qiv_handle_event(GdkEvent *ev, gpointer data)
       break;
   }
   if (exit_slideshow) slide = 0;
+  qiv_timer_update();  /* The slideshow may have been turned on or off. */
   if (do_make_multiline_window_unclean) mws.is_clean = FALSE;
 }
@@ -0,0 +1,294 @@
+/*
+  Module       : filelist.c
+  Purpose      : Read image file names from lists (qiv -F)
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* The names in a list are separated by newlines, or by NULs with -0 (for
+ * find -print0), and they have no length limit. The names are not copied:
+ * a regular file is mapped (privately, the separators are overwritten with
+ * NULs), other files are read in chunks, and image_names points into
+ * them. So the memory used is about the size of the list, plus a pointer
+ * per name.
+ *
+ * A list which is not a regular file (a pipe from find, or a slow network
+ * stream) is read only until it has an image, and the rest is read in the
+ * main loop, so the first image is displayed while the list is still being
+ * written. Sorted image_names are kept sorted, merging the new names the
+ * same way as scan.c does for directories read in the background.
+ */
+
+#define FILE_LIST_CHUNK_SIZE 65536
+/* The [idx/total] in the title is updated at most this often while a list
+ * is being read.
+ */
+#define FILE_LIST_UPDATE_MS 200
+
+typedef struct {
+  char **names;
+  size_t count, cap;
+} qiv_list_names;
+
+typedef struct {
+  int fd;
+  char sep;
+  char *filename;
+  char *chunk;  /* The names of the list are carved from it in place. */
+  size_t start;  /* Of the first incomplete name in chunk. */
+  size_t len, cap;
+} qiv_list_reader;
+
+static qiv_list_reader *stream;  /* The list read in the main loop. */
+static qiv_image *stream_q;
+static gboolean is_stream_sorted;
+static qiv_list_names stream_names, pending_names;
+static guint update_timer;
+static unsigned long list_names, list_bytes, list_mapped_bytes;
+static struct timeval stream_start;
+static double stream_secs = -1;
+
+static void list_add(qiv_list_names *list, char *name) {
+  if (list->count == list->cap) {
+    list->cap = list->cap ? list->cap * 2 : 1024;
+    list->names = (char**)xrealloc(list->names, list->cap * sizeof *list->names);
+  }
+  list->names[list->count++] = name;
+}
+
+static void add_name(qiv_list_names *list, char *name, char sep) {
+  size_t len = strlen(name);
+  if (sep == '\n' && len > 0 && name[len - 1] == '\r') name[--len] = '\0';
+  if (len > 0) list_add(list, name);  /* Skip empty lines. */
+}
+
+/* Splits buf[0..len) at sep to NUL-terminated names, and adds them to
+ * list. Returns the length of the complete names, the rest is an
+ * unterminated last name.
+ */
+static size_t split_names(char *buf, size_t len, char sep, qiv_list_names *list) {
+  char *p = buf, *end = buf + len, *q;
+  while ((q = memchr(p, sep, end - p)) != NULL) {
+    *q = '\0';
+    add_name(list, p, sep);
+    p = q + 1;
+  }
+  return p - buf;
+}
+
+/* Adds the last name of a list if it has no separator after it. */
+static void add_last_name(const char *p, size_t len, char sep, qiv_list_names *list) {
+  char *name;
+  if (!len) return;
+  name = (char*)xpool_alloc(len + 1);
+  memcpy(name, p, len);
+  name[len] = '\0';
+  add_name(list, name, sep);
+}
+
+/* Splits a mapping of the regular file fd. Returns FALSE if it can't be
+ * mapped.
+ */
+static gboolean map_names(int fd, size_t size, char sep, qiv_list_names *list) {
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  size_t done;
+  if (map == MAP_FAILED) return FALSE;
+  madvise(map, size, MADV_SEQUENTIAL);
+  done = split_names(map, size, sep, list);
+  add_last_name(map + done, size - done, sep, list);
+  list_bytes += size;
+  list_mapped_bytes += size;
+  return TRUE;
+}
+
+/* Reads the next part of the list, and adds the complete names in it to
+ * list. Returns FALSE at the end of the list.
+ */
+static gboolean read_names(qiv_list_reader *r, qiv_list_names *list) {
+  ssize_t got;
+  if (r->len == r->cap) {  /* Move the incomplete name to a new chunk. */
+    size_t tail = r->len - r->start, cap = FILE_LIST_CHUNK_SIZE;
+    char *chunk;
+    while (cap < tail * 2) cap *= 2;
+    chunk = (char*)xmalloc(cap);
+    if (tail) memcpy(chunk, r->chunk + r->start, tail);
+    if (r->start == 0) free(r->chunk);  /* No names point to it. */
+    r->chunk = chunk;
+    r->start = 0;
+    r->len = tail;
+    r->cap = cap;
+  }
+  got = read(r->fd, r->chunk + r->len, r->cap - r->len);
+  if (got < 0 && errno == EINTR) return TRUE;
+  if (got <= 0) {
+    if (got < 0)
+      g_print("Error while reading %s: %s\n", r->filename, strerror(errno));
+    add_last_name(r->chunk + r->start, r->len - r->start, r->sep, list);
+    return FALSE;
+  }
+  list_bytes += got;
+  r->len += got;
+  r->start += split_names(r->chunk + r->start, r->len - r->start, r->sep, list);
+  return TRUE;
+}
+
+static void close_reader(qiv_list_reader *r) {
+  if (r->fd != 0) close(r->fd);
+  /* r->chunk is kept, image_names point to it. */
+  free(r->filename);
+  free(r);
+}
+
+/* Adds a name read in the main loop. */
+static void add_streamed_name(char *name) {
+  if (!is_image_name_accepted(name)) return;
+  if (is_stream_sorted)
+    list_add(&pending_names, name);
+  else
+    append_image_name(name);
+}
+
+/* Adds the names read from a list to image_names, and the files in the
+ * directories among them.
+ */
+static void add_list_names(qiv_list_names *list) {
+  struct stat sb;
+  size_t i;
+
+  if (!do_assume_files)
+    stat_cache_fill(list->names, list->count);
+  for (i = 0; i < list->count; ++i) {
+    char *name = list->names[i];
+    if (!do_assume_files && stat_cache_stat(name, &sb, FALSE) >= 0 && S_ISDIR(sb.st_mode)) {
+      stat_cache_forget(name);
+      /* When streamed, they are filtered and merged. */
+      rreaddir_each(name, 1, stream_q ? add_streamed_name : append_image_name);
+    } else if (stream_q) {
+      add_streamed_name(name);
+    } else {
+      append_image_name(name);
+    }
+  }
+  list_names += list->count;
+  list->count = 0;
+}
+
+/* Reads image file names from filename (- for stdin). If is_streamed and
+ * the list is not a regular file, it's read only up to the first image,
+ * and the rest in the main loop (see file_list_attach()). Returns the
+ * number of images added, or -1 if filename can't be opened.
+ */
+int rreadfile(const char *filename, gboolean is_streamed)
+{
+  qiv_list_reader *r;
+  qiv_list_names list = {NULL, 0, 0};
+  struct stat st;
+  int fd, before_count = images, checked_idx = images;
+  char sep = null_separated ? '\0' : '\n';
+
+  if (strcmp(filename, "-")) {
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+  } else {
+    fd = 0;
+  }
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      map_names(fd, st.st_size, sep, &list)) {
+    if (fd != 0) close(fd);
+    add_list_names(&list);
+    free(list.names);
+    return images - before_count;
+  }
+
+  r = (qiv_list_reader*)xcalloc(1, sizeof *r);
+  r->fd = fd;
+  r->sep = sep;
+  r->filename = strdup(filename);
+  if (is_streamed) gettimeofday(&stream_start, 0);
+  while (read_names(r, &list)) {
+    if (!is_streamed) continue;
+    add_list_names(&list);
+    while (checked_idx < images && !is_image_name_accepted(image_names[checked_idx]))
+      ++checked_idx;
+    if (checked_idx < images) {  /* Read the rest in the main loop. */
+      stream = r;
+      stream_names = list;
+      return images - before_count;
+    }
+  }
+  add_list_names(&list);
+  free(list.names);
+  close_reader(r);
+  return images - before_count;
+}
+
+static gboolean update_title(gpointer data) {
+  (void)data;
+  update_timer = 0;
+  update_image(stream_q, MOVED);  /* Update [idx/total] in the title. */
+  return FALSE;
+}
+
+static gboolean handle_list_input(GIOChannel *source, GIOCondition condition, gpointer data) {
+  /* Only one read(), the list may be a terminal, which must not be made
+   * non-blocking.
+   */
+  gboolean is_more = read_names(stream, &stream_names);
+  int before_count = images;
+  struct timeval after;
+  (void)source; (void)condition; (void)data;
+
+  add_list_names(&stream_names);
+  if (pending_names.count && (!is_more || pending_names.count >= (size_t)images / 2)) {
+    scan_merge_names(pending_names.names, pending_names.count);
+    pending_names.count = 0;
+  }
+  if (images != before_count && !update_timer)
+    update_timer = g_timeout_add(FILE_LIST_UPDATE_MS, update_title, NULL);
+  if (is_more) return TRUE;
+  gettimeofday(&after, 0);
+  close_reader(stream);
+  stream = NULL;
+  free(stream_names.names);
+  free(pending_names.names);
+  stream_names.names = pending_names.names = NULL;
+  stream_names.cap = pending_names.cap = 0;
+  stream_secs = (after.tv_sec - stream_start.tv_sec) + (after.tv_usec - stream_start.tv_usec) / 1.0e6;
+  return FALSE;
+}
+
+/* Reads the rest of a list streamed by rreadfile() in the main loop. */
+void file_list_attach(qiv_image *q)
+{
+  GIOChannel *channel;
+  if (!stream) return;
+  stream_q = q;
+  is_stream_sorted = is_image_names_sorted;
+  channel = g_io_channel_unix_new(stream->fd);
+  g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, handle_list_input, NULL);
+  g_io_channel_unref(channel);
+}
+
+void file_list_print_stats(void)
+{
+  if (!list_names) return;
+  g_print("file list: %lu names in %lu bytes (%lu mapped)\n",
+          list_names, list_bytes, list_mapped_bytes);
+  if (stream)
+    g_print("file list: still reading in the main loop\n");
+  else if (stream_secs >= 0)
+    g_print("file list: read in the main loop, all read after %.2fs\n", stream_secs);
+}
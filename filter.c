@@ -0,0 +1,219 @@
+/*
+  Module       : filter.c
+  Purpose      : Filter image file names by extension and contents
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* Files without an image extension are checked by their first bytes (see
+ * sniff.c). The files of a long list are read by a pool of threads, to
+ * keep many reads in flight on slow (network) filesystems. The result is
+ * recorded in the metadata index (see metaindex.c) for files statted in
+ * advance (qiv -F, or file names given), so next time they aren't read.
+ *
+ * With --lazy_filter, files without an image extension are kept in the
+ * list, and checked only when they are about to be displayed (see
+ * filter_accept_lazily()) or prefetched, so the first image is shown
+ * without waiting for the others to be checked.
+ */
+
+#define FILTER_MAX_THREADS 64
+/* Lists shorter than this are checked by the calling thread. */
+#define FILTER_NAMES_PER_THREAD 64
+
+typedef struct {
+  char **names;
+  int *todo;  /* Indexes of names to be checked by their contents. */
+  char *is_accepted;  /* Indexed like names. */
+  int count;
+  int next_idx;
+} qiv_filter_batch;
+
+static GHashTable *lazy_results;  /* Name -> 1 if accepted, 2 if not. */
+static unsigned long filter_names, filter_sniffs, filter_indexed, lazy_checks, lazy_dropped;
+static double filter_secs;
+static int filter_max_threads;
+
+static int check_extension(const char *name)
+{
+  char *extn = strrchr(name, '.');
+  int i;
+
+  if (extn)
+    for (i=0; image_extensions[i]; i++)
+      if (strcasecmp(extn, image_extensions[i]) == 0)
+        return 1;
+
+  return 0;
+}
+
+static int check_contents(const char *name)
+{
+  struct stat st;
+  qiv_meta m;
+  int result;
+
+  __atomic_add_fetch(&filter_sniffs, 1, __ATOMIC_RELAXED);
+  /* Don't open files already known to be missing or not regular, or
+   * already recorded in the metadata index.
+   */
+  switch (stat_cache_lookup(name, &st)) {
+    case -1: return sniff_image_file(name) > 0;
+    case 0: return 0;
+  }
+  if (!S_ISREG(st.st_mode)) return 0;
+  if (meta_index_get(&st, &m) && m.type != META_TYPE_UNKNOWN) {
+    __atomic_add_fetch(&filter_indexed, 1, __ATOMIC_RELAXED);
+    return m.type == META_TYPE_IMAGE;
+  }
+  if ((result = sniff_image_file(name)) >= 0) {
+    m.type = result ? META_TYPE_IMAGE : META_TYPE_NOT_IMAGE;
+    meta_index_put(&st, &m);
+  }
+  return result > 0;
+}
+
+static void *filter_worker(void *arg) {
+  qiv_filter_batch *batch = (qiv_filter_batch*)arg;
+  int i, idx;
+  while ((i = __atomic_fetch_add(&batch->next_idx, 1, __ATOMIC_RELAXED)) < batch->count) {
+    idx = batch->todo[i];
+    batch->is_accepted[idx] = check_contents(batch->names[idx]);
+  }
+  return NULL;
+}
+
+/* Checks the contents of names[todo[0..count)], in parallel. */
+static void check_contents_all(char **names, int *todo, int count, char *is_accepted) {
+  qiv_filter_batch batch;
+  pthread_t threads[FILTER_MAX_THREADS];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_count = count / FILTER_NAMES_PER_THREAD, started, i;
+
+  /* Mostly waiting for the reads, so more threads than CPUs. */
+  if (cpus > 0 && thread_count > cpus * 2) thread_count = cpus * 2;
+  if (thread_count > FILTER_MAX_THREADS) thread_count = FILTER_MAX_THREADS;
+  if (thread_count < 1) thread_count = 1;
+  batch.names = names;
+  batch.todo = todo;
+  batch.is_accepted = is_accepted;
+  batch.count = count;
+  batch.next_idx = 0;
+  /* The calling thread is one of the workers. */
+  for (started = 1; started < thread_count; ++started) {
+    if (pthread_create(&threads[started], NULL, filter_worker, &batch) != 0) break;
+  }
+  filter_worker(&batch);
+  for (i = 1; i < started; ++i) pthread_join(threads[i], NULL);
+  if (started > filter_max_threads) filter_max_threads = started;
+}
+
+static gboolean is_lazy(void) {
+  return lazy_filter && !make_thumbnails && !make_index;
+}
+
+/* Filter images by extension (and contents) */
+void filter_images(int *images, char **image_names)
+{
+  int i, j, new_idx = -1, todo_count = 0;
+  char *is_accepted;
+  int *todo;
+  struct timeval before, after;
+
+  gettimeofday(&before, 0);
+  is_accepted = (char*)xmalloc(*images + 1);
+  todo = (int*)xmalloc((*images + 1) * sizeof *todo);
+  for (i = 0; i < *images; ++i) {
+    if (!(is_accepted[i] = check_extension(image_names[i]))) {
+      todo[todo_count++] = i;
+      is_accepted[i] = is_lazy();  /* Checked when shown. */
+    }
+  }
+  if (todo_count && !is_lazy())
+    check_contents_all(image_names, todo, todo_count, is_accepted);
+
+  /* Keep the accepted ones in one pass, and image_idx pointing to the same
+   * image (or the next one, if it's dropped).
+   */
+  for (i = j = 0; i < *images; ++i) {
+    if (i == image_idx)
+      new_idx = j;
+    if (is_accepted[i])
+      image_names[j++] = image_names[i];
+  }
+  filter_names += *images;
+  *images = j;
+  image_idx = new_idx < 0 || new_idx >= j ? 0 : new_idx;
+  name_index_invalidate();
+  free(todo);
+  free(is_accepted);
+  gettimeofday(&after, 0);
+  filter_secs += (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1.0e6;
+}
+
+/* Returns 1 if name would be kept by options_read() and filter_images(),
+ * for images found later by --watch_dirs. Can be called by any thread.
+ */
+int is_image_name_accepted(const char *name)
+{
+  size_t len = strlen(name);
+  if (thumbnail && len >= 7 && 0 == memcmp(name + len - 7, ".th.jpg", 7))
+    return 0;
+  if (!filter || check_extension(name) || is_lazy())
+    return 1;
+  return check_contents(name);
+}
+
+/* With --lazy_filter, checks the file name kept by filter_images() without
+ * an image extension. Returns 0 if it's not an image. Remembers the
+ * result, so it can be called for images to be prefetched, and again when
+ * they are shown.
+ */
+int filter_accept_lazily(const char *name)
+{
+  int result;
+  if (!filter || !is_lazy() || check_extension(name)) return 1;
+  if (!lazy_results) lazy_results = g_hash_table_new(g_str_hash, g_str_equal);
+  if ((result = GPOINTER_TO_INT(g_hash_table_lookup(lazy_results, name))) == 0) {
+    ++lazy_checks;
+    result = check_contents(name) ? 1 : 2;
+    if (result == 2) ++lazy_dropped;
+    /* name is not freed when removed from image_names. */
+    g_hash_table_insert(lazy_results, (char*)name, GINT_TO_POINTER(result));
+  }
+  return result == 1;
+}
+
+/* With --no_filter, returns 0 if name (about to be loaded) has no image
+ * extension, and its contents are not of an image format compiled in, so
+ * Imlib2 doesn't try all its loaders on it.
+ */
+int filter_is_loadable(const char *name)
+{
+  if (filter || check_extension(name)) return 1;
+  return sniff_image_file(name) != 0;  /* Let Imlib2 report read errors. */
+}
+
+void filter_print_stats(void)
+{
+  if (!filter_names) return;
+  g_print("filter: %lu names in %.2fs, %lu checked by contents (%d threads), "
+          "%lu of them found in the metadata index\n",
+          filter_names, filter_secs, filter_sniffs - lazy_checks,
+          filter_max_threads, filter_indexed);
+  if (lazy_checks)
+    g_print("filter: %lu checked lazily, %lu of them dropped\n",
+            lazy_checks, lazy_dropped);
+}
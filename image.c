@@ -99,21 +99,15 @@ enum Orientation orient( const char * path) {
 }
 #endif  //HAVE_EXIF
 
-/* The caller takes ownership of the returned value. */
-static char* get_thumbnail_filename(const char *filename, char *is_maybe_image_file_out) {
+/* Returns filename with its image extension replaced by .th.jpg. The
+ * caller takes ownership of the returned value.
+ */
+char *get_th_jpg_filename(const char *filename) {
   const char *r;
   const char *p;
   char *thumbnail_filename;
-  char *tmp_filename = NULL;
   size_t prefixlen;
-  struct stat st;
-  char link_target[512];
-  ssize_t readlink_result;
-  char do_try_readlink = 1;
-
- again:
   p = r = filename + strlen(filename);
-  /* Replace image extension with .th.jpg, save result to thumbnail_filename */
   while (p != filename && p[-1] != '/' && p[-1] != '.') {
     --p;
   }
@@ -122,16 +116,29 @@ static char* get_thumbnail_filename(const char *filename, char *is_maybe_image_f
   thumbnail_filename = xmalloc(prefixlen + 8);
   memcpy(thumbnail_filename, filename, prefixlen);
   strcpy(thumbnail_filename + prefixlen, ".th.jpg");
+  return thumbnail_filename;
+}
+
+/* The caller takes ownership of the returned value. */
+static char* get_thumbnail_filename(const char *filename, char *is_maybe_image_file_out) {
+  char *thumbnail_filename;
+  char *tmp_filename = NULL;
+  char link_target[512];
+  ssize_t readlink_result;
+  char do_try_readlink = 1;
+
+ again:
+  thumbnail_filename = get_th_jpg_filename(filename);
   free(tmp_filename);  /* From this point `filename' is useless */
 
-  if (0 == stat(thumbnail_filename, &st) && S_ISREG(st.st_mode)) {
+  if (dircache_has_thumbnail(thumbnail_filename)) {
     return thumbnail_filename;
   }
   free(thumbnail_filename);
 
   if (!do_try_readlink) {
     /* Already followed the .git/annex/object symlink, don't try to follow another symlink. */
-  } else if ((readlink_result = readlink(filename, link_target, sizeof(link_target))) > 0 &&
+  } else if ((readlink_result = dircache_readlink(filename, link_target, sizeof(link_target))) > 0 &&
              (size_t)readlink_result < sizeof(link_target)) {
     /* It's a symlink and it's not too long. For example (198 bytes):
      * ../.git/annex/objects/G1/mX/SHA256E-s12345--aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.jpg/SHA256E-s12345--aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa.jpg
@@ -220,6 +227,65 @@ static int get_real_dimensions_fast(
   return -6;  /* REALDIMEN: comment not found. */
 }
 
+/* Saves the image in the Imlib2 context as a JPEG file with a
+ * REALDIMEN:<real_w>x<real_h> comment (see get_real_dimensions_fast). The
+ * file is written to a temporary file first, and then renamed to filename.
+ * Returns 0 on success.
+ */
+int save_jpeg_with_realdimen(const char *filename, gint real_w, gint real_h,
+                             int quality) {
+  char *tmp_name, *tmp2_name;
+  char comment[40];
+  FILE *f;
+  char *data = NULL;
+  long size = 0;
+  int comment_size, result = -1;
+
+  tmp_name = xmalloc(strlen(filename) + 24);
+  tmp2_name = xmalloc(strlen(filename) + 24);
+  sprintf(tmp_name, "%s.tmp%d", filename, (int)getpid());
+  sprintf(tmp2_name, "%s.tmp%dc", filename, (int)getpid());
+  imlib_image_set_format("jpg");
+  imlib_image_attach_data_value("quality", NULL, quality, NULL);
+  imlib_save_image(tmp_name);
+
+  /* Imlib2 doesn't write comments, insert it right after SOI. */
+  if ((f = fopen(tmp_name, "rb")) == NULL) goto done;
+  if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 2 &&
+      fseek(f, 0, SEEK_SET) == 0) {
+    data = xmalloc(size);
+    if (fread(data, 1, size, f) != (size_t)size ||
+        (unsigned char)data[0] != 0xff || (unsigned char)data[1] != 0xd8) {
+      free(data);
+      data = NULL;
+    }
+  }
+  fclose(f);
+  unlink(tmp_name);
+  if (!data) goto done;
+  comment_size = g_snprintf(comment, sizeof comment, "REALDIMEN:%dx%d",
+                            real_w, real_h);
+  if ((f = fopen(tmp2_name, "wb")) == NULL) goto done;
+  putc(0xff, f);
+  putc(0xd8, f);
+  putc(0xff, f);
+  putc(0xfe, f);
+  putc((comment_size + 2) >> 8, f);
+  putc((comment_size + 2) & 255, f);
+  fwrite(comment, 1, comment_size, f);
+  fwrite(data + 2, 1, size - 2, f);
+  if (fclose(f) != 0 || rename(tmp2_name, filename) != 0) {
+    unlink(tmp2_name);
+    goto done;
+  }
+  result = 0;
+ done:
+  free(data);
+  free(tmp_name);
+  free(tmp2_name);
+  return result;
+}
+
 /* Populates *w_out and *h_out with the dimensions of the image file
  * specified in image_name. On an error, returns a negative number and keeps
  * w_out and h_out unset.
@@ -390,7 +456,91 @@ static void get_image_dimensions(
   }
 }
 
+/* Like get_image_dimensions(), but answered from the metadata index if
+ * possible. st is NULL if image_name couldn't be statted.
+ */
+static void get_indexed_dimensions(
+    const char *image_name, const char *th_image_name, const struct stat *st,
+    gint *w_out, gint *h_out) {
+  qiv_meta m;
+  if (st && meta_index_get(st, &m) && m.w >= 0) {
+    *w_out = m.w;
+    *h_out = m.h;
+    return;
+  }
+  get_image_dimensions(image_name, th_image_name, w_out, h_out);
+  if (st && *w_out >= 0) {
+    m.w = *w_out;
+    m.h = *h_out;
+    meta_index_put(st, &m);
+  }
+}
+
+#ifdef HAVE_EXIF
+/* Like orient(), but answered from the metadata index if possible. */
+static enum Orientation get_indexed_orientation(const char *image_name, const struct stat *st) {
+  qiv_meta m;
+  if (st && meta_index_get(st, &m) && m.orientation >= 0)
+    return (enum Orientation)m.orientation;
+  m.orientation = orient(image_name);
+  if (st) meta_index_put(st, &m);
+  return (enum Orientation)m.orientation;
+}
+#endif
+
+/* Fills m with the metadata of image_name read from the file, for
+ * qiv --index.
+ */
+void get_image_meta(const char *image_name, qiv_meta *m)
+{
+  meta_init(m);
+  get_image_dimensions(image_name, NULL, &m->w, &m->h);
+  if (m->w >= 0) m->type = META_TYPE_IMAGE;
+#ifdef HAVE_EXIF
+  m->orientation = orient(image_name);
+#endif
+}
+
 static void update_image_on_error(qiv_image *q);
+static void skip_image(void);
+static void close_error_gap(void);
+/* Images after image_idx which failed to load, see skip_image(). */
+static int error_gap;
+
+static void get_maxpect_screen_size(gint *w_out, gint *h_out) {
+#ifdef GTD_XINERAMA
+  *w_out = preferred_screen->width;
+  *h_out = preferred_screen->height;
+#else
+  *w_out = screen_x;
+  *h_out = screen_y;
+#endif
+}
+
+/* Returns the render cache file name for image_name if it would be
+ * displayed shrunk to the screen size, or NULL.
+ */
+static char *get_render_cache_filename(const char *image_name, const struct stat *st) {
+  gint screen_w, screen_h;
+  if (!(maxpect || scale_down) || fixed_window_size || fixed_zoom_factor ||
+      to_root || to_root_t || to_root_s) return NULL;
+  get_maxpect_screen_size(&screen_w, &screen_h);
+  return render_cache_filename(image_name, st, screen_w, screen_h);
+}
+
+/* File name and stat of the image in the Imlib2 context, for cache_put. */
+static char *loaded_name;
+static struct stat loaded_st;
+
+/* Frees the image in the Imlib2 context (if any), keeping a compressed
+ * copy of it in the cache if it's unchanged since loading.
+ */
+static void free_loaded_image(qiv_image *q) {
+  if (!imlib_context_get_image()) return;
+  if (q->is_cacheable && loaded_name) cache_put(loaded_name, &loaded_st);
+  q->is_cacheable = FALSE;
+  imlib_free_image();
+}
 
 /*
  *    Load & display image
@@ -408,33 +558,52 @@ void qiv_load_image(qiv_image *q) {
    */
   char is_maybe_image_file;
   char is_first_error = 1;
+  /* The pixels in im come from cache_get or render_cache_get, already
+   * autorotated.
+   */
+  gboolean is_cached;
+  char *render_name = NULL;
 
  load_next_image:
+  g_free(render_name);
+  render_name = NULL;
   is_stat_ok = 0;
   is_maybe_image_file = 1;
+  is_cached = FALSE;
   image_name = image_names[image_idx];
+  if (!filter_accept_lazily(image_name)) {  /* Not an image, skip it quietly. */
+    skip_image();
+    goto load_next_image;
+  }
   gettimeofday(&load_before, 0);
 
-  if (imlib_context_get_image())
-    imlib_free_image();
+  free_loaded_image(q);
 
   q->real_w = q->real_h = -2;
   q->has_thumbnail = FALSE;
+  q->has_render = FALSE;
   if (!do_omit_load_stat) {
-    is_stat_ok = 0 == stat(image_name, &st);
+    is_stat_ok = 0 == stat_cache_stat(image_name, &st, TRUE);
     is_maybe_image_file = is_stat_ok && S_ISREG(st.st_mode);
   }
+  if (is_maybe_image_file && !filter_is_loadable(image_name))
+    is_maybe_image_file = 0;  /* --no_filter, and not an image. */
   current_mtime = is_stat_ok ? st.st_mtime : 0;
+  watch_file_update(q);
   im = NULL;
   if (thumbnail && fullscreen && (is_stat_ok || maxpect)) {
     char *th_image_name =
         is_maybe_image_file ?
         get_thumbnail_filename(image_name, &is_maybe_image_file) : NULL;
+    if (!th_image_name && is_maybe_image_file && is_stat_ok) {
+      th_image_name = xdg_thumbnail_filename(image_name, &st);
+    }
     if (th_image_name) {
-      im = imlib_load_image(th_image_name);
+      im = decoder_load_image(th_image_name);
       if (im && maxpect) {
-        get_image_dimensions(image_name, th_image_name,
-                             &q->real_w, &q->real_h);
+        get_indexed_dimensions(image_name, th_image_name,
+                               is_stat_ok ? &st : NULL,
+                               &q->real_w, &q->real_h);
       }
       free(th_image_name);
       th_image_name = NULL;
@@ -448,10 +617,27 @@ void qiv_load_image(qiv_image *q) {
     } else {  /* Use the real, non-thumbnail image instead. */
       imlib_context_set_image(im);
       imlib_free_image();
-      im = is_maybe_image_file ? imlib_load_image((char*)image_name) : NULL;
+      im = is_maybe_image_file ? decoder_load_image(image_name) : NULL;
+    }
+  } else if (is_stat_ok && is_maybe_image_file &&
+             (render_name = get_render_cache_filename(image_name, &st)) != NULL &&
+             (im = render_cache_get(render_name)) != NULL) {
+    FILE *f = fopen(render_name, "rb");
+    if (f) {
+      get_real_dimensions_fast(f, &q->real_w, &q->real_h);
+      fclose(f);
     }
+    is_cached = TRUE;
+    q->has_render = TRUE;
+  } else if (is_stat_ok && is_maybe_image_file &&
+             (im = cache_get(image_name, &st)) != NULL) {
+    is_cached = TRUE;
+  } else if (is_stat_ok && is_maybe_image_file &&
+             (im = shm_cache_get(&st)) != NULL) {
+    /* Decoded by another qiv process. */
   } else {
-    im = is_maybe_image_file ? imlib_load_image((char*)image_name) : NULL;
+    im = is_maybe_image_file ? decoder_load_image(image_name) : NULL;
+    if (im && is_stat_ok) shm_cache_put(&st, im);
   }
 
   if (!im) { /* error */
@@ -476,7 +662,6 @@ void qiv_load_image(qiv_image *q) {
       is_first_error = 0;
     }
 
-    /* TODO(pts): Avoid the slow loop of copying pointers around in update_image_on_error. */
     update_image_on_error(q);
     /* This is a shortcut to avoid stack overflow in the recursion of
      * qiv_load_image -> update_image -> qiv_load_image -> update_image -> ...
@@ -484,6 +669,7 @@ void qiv_load_image(qiv_image *q) {
      */
     goto load_next_image;
   }
+  close_error_gap();
 
   if (thumbnail && !q->has_thumbnail && q->real_w < 0 && is_maybe_image_file) {
     FILE *f = fopen(image_name, "rb");
@@ -512,11 +698,25 @@ void qiv_load_image(qiv_image *q) {
     imlib_image_query_pixel(0, 0, &c);
     imlib_image_set_has_alpha(0);
   }
+  if (is_stat_ok && !is_cached && !q->has_thumbnail) {
+    qiv_meta m;
+    meta_init(&m);
+    m.w = q->orig_w;
+    m.h = q->orig_h;
+    m.type = META_TYPE_IMAGE;
+    meta_index_put(&st, &m);
+  }
 #ifdef HAVE_EXIF
-  if (autorotate) {
-    transform( q, orient( image_name));
+  if (autorotate && !is_cached) {
+    transform( q, get_indexed_orientation( image_name, is_stat_ok ? &st : NULL));
   }
 #endif
+  if (is_stat_ok && !q->has_thumbnail && !q->has_render) {
+    free(loaded_name);
+    loaded_name = strdup(image_name);
+    loaded_st = st;
+    q->is_cacheable = TRUE;
+  }
 
   check_size(q, TRUE);
 
@@ -544,6 +744,20 @@ void qiv_load_image(qiv_image *q) {
 //     setup_magnify(q, &magnify_img);
 //     update_magnify(q, &magnify_img, FULL_REDRAW, 0, 0);
 //    }
+
+  /* The image is already displayed, save the shrunk version for next time. */
+  if (render_name && !q->has_render && !q->has_thumbnail &&
+      q->win_w < q->orig_w && q->win_h < q->orig_h) {
+    gdk_flush();
+    render_cache_put(render_name, q->win_w, q->win_h, q->orig_w, q->orig_h);
+  }
+  if (do_write_xdg_thumbnails && q->is_cacheable) {
+    xdg_thumbnail_schedule(q, image_name, &st);
+  }
+  g_free(render_name);
+
+  /* Decode the images most likely to be shown next in the background. */
+  prefetch_plan();
 }
 
 static gchar blank_cursor[1];
@@ -762,11 +976,48 @@ void set_desktop_image(qiv_image *q)
   setup_imlib_for_drawable(q->win);
 }
 
+/*
+ * Replaces a shrunk image from the render cache with the full image,
+ * keeping the window size. Needed before zooming.
+ */
+void load_full_resolution(qiv_image *q)
+{
+  const char *image_name = image_names[image_idx];
+  gint win_w = q->win_w, win_h = q->win_h;
+  Imlib_Image im;
+  struct stat st;
+  gboolean is_stat_ok;
+
+  if (!q->has_render) return;
+  q->has_render = FALSE;
+  if ((im = decoder_load_image(image_name)) == NULL) return;
+  if (imlib_context_get_image())
+    imlib_free_image();
+  imlib_context_set_image(im);
+  q->orig_w = imlib_image_get_width();
+  q->orig_h = imlib_image_get_height();
+  is_stat_ok = stat(image_name, &st) == 0;
+#ifdef HAVE_EXIF
+  if (autorotate) {
+    transform( q, get_indexed_orientation( image_name, is_stat_ok ? &st : NULL));
+  }
+#endif
+  q->win_w = win_w;
+  q->win_h = win_h;
+  if (is_stat_ok) {
+    free(loaded_name);
+    loaded_name = strdup(image_name);
+    loaded_st = st;
+    q->is_cacheable = TRUE;
+  }
+}
+
 void zoom_in(qiv_image *q)
 {
   int zoom_percentage;
   int w_old, h_old;
 
+  load_full_resolution(q);
   /* first compute current zoom_factor */
   if (maxpect || scale_down || fixed_window_size) {
     zoom_percentage=myround((1.0-(q->orig_w - q->win_w)/(double)q->orig_w)*100);
@@ -800,6 +1051,7 @@ void zoom_out(qiv_image *q)
   int zoom_percentage;
   int w_old, h_old;
 
+  load_full_resolution(q);
   /* first compute current zoom_factor */
   if (maxpect || scale_down || fixed_window_size) {
     zoom_percentage=myround((1.0-(q->orig_w - q->win_w)/(double)q->orig_w)*100);
@@ -836,13 +1088,11 @@ void zoom_out(qiv_image *q)
 
 void zoom_maxpect(qiv_image *q)
 {
-#ifdef GTD_XINERAMA
-  double zx = (double)preferred_screen->width / (double)q->orig_w;
-  double zy = (double)preferred_screen->height / (double)q->orig_h;
-#else
-  double zx = (double)screen_x / (double)q->orig_w;
-  double zy = (double)screen_y / (double)q->orig_h;
-#endif
+  gint screen_w, screen_h;
+  double zx, zy;
+  get_maxpect_screen_size(&screen_w, &screen_h);
+  zx = (double)screen_w / (double)q->orig_w;
+  zy = (double)screen_h / (double)q->orig_h;
   /* titlebar and frames ignored on purpose to use full height/width of screen */
   q->win_w = (gint)(q->orig_w * MIN(zx, zy));
   q->win_h = (gint)(q->orig_h * MIN(zx, zy));
@@ -858,7 +1108,7 @@ void reload_image(qiv_image *q)
 {
   imlib_image_set_changes_on_disk();
 
-  Imlib_Image *im = imlib_load_image(image_names[image_idx]);
+  Imlib_Image *im = decoder_load_image(image_names[image_idx]);
   if (!im && watch_file)
     return;
 
@@ -866,6 +1116,8 @@ void reload_image(qiv_image *q)
   stat(image_names[image_idx], &statbuf);
   current_mtime = statbuf.st_mtime;
 
+  q->is_cacheable = FALSE;  /* The file has changed. */
+  q->has_render = FALSE;
   if (imlib_context_get_image())
     imlib_free_image();
 
@@ -941,23 +1193,31 @@ static void update_win_title(qiv_image *q) {
 }
 
 static void update_image_on_error(qiv_image *q) {
-  int i;
-
   if (!q->error) return;  /* Unexpected. */
   g_snprintf(q->win_title_no_infotext, sizeof q->win_title_no_infotext,
       "qiv: ERROR! cannot load image: %s", image_names[image_idx]);
   q->infotext = NULL;
   gdk_beep();
+  skip_image();
 
-  /* take this image out of the file list */
-  --images;
-  for(i=image_idx;i<images;++i) {
-    image_names[i] = image_names[i+1];
-  }
+  /* The caller should continue with the call to: qiv_load_image(q); */
+}
 
-  /* If deleting the last file out of x */
-  if(images == image_idx)
+/* Takes image_idx out of the file list: replaces it with the next one,
+ * and leaves a gap after image_idx, closed by close_error_gap(). So
+ * skipping many unreadable files in a row moves the rest of the list only
+ * once.
+ */
+static void skip_image(void) {
+  name_index_remove(image_idx);
+  if (image_idx + error_gap + 1 < images) {
+    ++error_gap;
+    image_names[image_idx] = image_names[image_idx + error_gap];
+  } else {  /* If deleting the last file out of x */
+    images = image_idx;
+    error_gap = 0;
     image_idx = 0;
+  }
 
   /* If deleting the only file left */
   if(!images) {
@@ -966,8 +1226,15 @@ static void update_image_on_error(qiv_image *q) {
 #endif
     exit(0);
   }
+}
 
-  /* The caller should continue with the call to: qiv_load_image(q); */
+/* Removes the images skipped by skip_image() from the list. */
+static void close_error_gap(void) {
+  if (!error_gap) return;
+  memmove(image_names + image_idx + 1, image_names + image_idx + 1 + error_gap,
+          (images - image_idx - 1 - error_gap) * sizeof *image_names);
+  images -= error_gap;
+  error_gap = 0;
 }
 
 #define MMIN(a, b) ((a) < (b) ? (a) : (b))
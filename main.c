@@ -8,32 +8,31 @@
 */
 
 #include <gdk/gdkx.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <ctype.h>
 #include <string.h>
 
-#ifdef HAVE_MAGIC
-#include <magic.h>
-#endif
-
 #include "qiv.h"
 #include "main.h"
 
 qiv_image main_img;
 qiv_mgl   magnify_img; /* [lc] */
 
-static void filter_images(int *, char **);
-static int check_extension(const char *);
+static gboolean qiv_signal_quit(gpointer);
 static void qiv_signal_usr1();
 static void qiv_signal_usr2();
 static gboolean qiv_handle_timer(gpointer);
 static void qiv_timer_restart(gpointer);
+static gint qiv_counting_poll(GPollFD *, guint, gint);
 
-#ifdef HAVE_MAGIC
-static int check_magic(const char *name);
-#endif
+static guint slide_timer;  /* Source ID while the slideshow is running. */
+static unsigned long slide_timer_count;
+static GPollFunc orig_poll_func;
+static unsigned long poll_count;
+static struct timeval loop_start;
 
 int main(int argc, char **argv)
 {
@@ -66,6 +65,22 @@ int main(int argc, char **argv)
   has_arg = argv[1] != NULL;
   options_read(argc, argv, &main_img);
 
+  if (make_thumbnails) {  /* Doesn't need the X server. */
+    if (filter)
+      filter_images(&images,image_names);
+    exit(make_thumbnail_files());
+  }
+  if (make_index) {  /* Doesn't need the X server either. */
+    stat_cache_fill(image_names, images);  /* Keyed by the stat. */
+    if (filter)
+      filter_images(&images,image_names);
+    exit(meta_index_build());
+  }
+
+  /* Start the decoder processes before connecting to the X server. */
+  decoder_pool_start();
+  shm_cache_start();
+
   /* Initialize GDK */
 
   gdk_init(&argc,&argv);
@@ -111,10 +126,9 @@ int main(int argc, char **argv)
 #endif
 
 
-  max_rand_num = images;
-
   if (filter) /* Filter graphic images */
     filter_images(&images,image_names);
+  scan_background_wait_first();
 
   if (!images) { /* No images to display */
     if (has_arg) {  /* argv had least one image or flag. */
@@ -145,23 +159,27 @@ int main(int argc, char **argv)
   /* Setup callbacks */
 
   gdk_event_handler_set(qiv_handle_event, &main_img, NULL);
-  qiv_timer_restart(NULL);
+  qiv_timer_update();
 
   /* And signal catchers */
 
-  signal(SIGTERM, finish);
-  signal(SIGINT, finish);
+  g_unix_signal_add(SIGTERM, qiv_signal_quit, NULL);
+  g_unix_signal_add(SIGINT, qiv_signal_quit, NULL);
   signal(SIGUSR1, qiv_signal_usr1);
   signal(SIGUSR2, qiv_signal_usr2);
 
   /* Load & display the first image */
 
   qiv_load_image(&main_img);
-
-  if(watch_file){
-    g_idle_add (qiv_watch_file, &main_img);
+  watch_dirs_start(&main_img);
+  scan_background_attach(&main_img);
+  file_list_attach(&main_img);
+
+  if (do_print_stats) {  /* Count the wakeups of the main loop. */
+    orig_poll_func = g_main_context_get_poll_func(NULL);
+    g_main_context_set_poll_func(NULL, qiv_counting_poll);
+    gettimeofday(&loop_start, 0);
   }
-
   g_main_run(qiv_main_loop); /* will never return */
   return 0;
 }
@@ -186,6 +204,16 @@ void qiv_exit(int code)
  * functions for handling signals
  */
 
+/* SIGTERM and SIGINT. Called by the main loop, not in the signal handler,
+ * so finish() can take locks and save the metadata index.
+ */
+static gboolean qiv_signal_quit(gpointer data)
+{
+  (void)data;
+  qiv_exit(0);
+  return FALSE;
+}
+
 static void qiv_signal_usr1()
 {
   next_image(1);
@@ -204,12 +232,14 @@ static void qiv_signal_usr2()
  *
  * If this function returns false, the timer is destroyed
  * and qiv_timer_restart() is automatically called, which
- * then starts the timer again. Thus images which takes some
- * time to load will still be displayed for "delay" seconds.
+ * then starts the timer again if the slideshow is still running.
+ * Thus images which takes some time to load will still be
+ * displayed for "delay" seconds.
  */
 
 static gboolean qiv_handle_timer(gpointer data)
 {
+  ++slide_timer_count;
   if (*(int *)data || slide) {
     next_image(0);
     qiv_load_image(&main_img);
@@ -255,73 +285,44 @@ gint add_to_delay(gint delay_delta) {
 static void qiv_timer_restart(gpointer dummy)
 {
   (void)dummy;
-  g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, get_use_delay(delay),
-                     qiv_handle_timer, &slide,
-                     qiv_timer_restart);
+  slide_timer = 0;
+  qiv_timer_update();
 }
 
-/* Filter images by extension */
+/*
+ *    Arms the slideshow timer if the slideshow is running, and
+ *    removes it otherwise, so an idle qiv doesn't wake up.
+ */
 
-static void filter_images(int *images, char **image_names)
+void qiv_timer_update(void)
 {
-  int i = 0;
-
-  while(i < *images) {
-    if (check_extension(image_names[i])
-#ifdef HAVE_MAGIC
-            || check_magic(image_names[i])
-#endif
-       ) {
-      i++;
-    } else {
-      int j = i;
-      if (j < *images-1)
-          image_idx--;
-      while(j < *images-1) {
-        image_names[j] = image_names[j+1];
-        ++j;
-      }
-      --(*images);
-    }
+  guint id;
+  if (slide && !slide_timer) {
+    slide_timer = g_timeout_add_full(G_PRIORITY_DEFAULT_IDLE, get_use_delay(delay),
+                                     qiv_handle_timer, &slide,
+                                     qiv_timer_restart);
+  } else if (!slide && slide_timer) {
+    id = slide_timer;
+    slide_timer = 0;
+    g_source_remove(id);  /* Calls qiv_timer_restart(), which does nothing. */
   }
-  if (image_idx < 0)
-    image_idx = 0;
 }
 
-static int check_extension(const char *name)
+static gint qiv_counting_poll(GPollFD *ufds, guint nfds, gint timeout)
 {
-  char *extn = strrchr(name, '.');
-  int i;
-
-  if (extn)
-    for (i=0; image_extensions[i]; i++)
-      if (strcasecmp(extn, image_extensions[i]) == 0)
-        return 1;
-
-  return 0;
+  ++poll_count;
+  return orig_poll_func(ufds, nfds, timeout);
 }
 
-#ifdef HAVE_MAGIC
-static int check_magic(const char *name)
+void main_loop_print_stats(void)
 {
-  magic_t cookie;
-  const char *description=NULL;
-  int i;
-  int ret=0;
-
-  cookie = magic_open(MAGIC_NONE);
-  magic_load(cookie,NULL);
-  description = magic_file(cookie, name);
-  if(description)
-  {
-    for(i=0; image_magic[i]; i++ )
-      if (strncasecmp(description, image_magic[i], strlen(image_magic[i])) == 0)
-      {
-        ret = 1;
-        break;
-      }
-  }
-  magic_close(cookie);
-  return ret;
+  struct timeval now;
+  double elapsed;
+  if (!orig_poll_func) return;
+  gettimeofday(&now, 0);
+  elapsed = (now.tv_sec - loop_start.tv_sec) + (now.tv_usec - loop_start.tv_usec) / 1.0e6;
+  g_print("main_loop: %lu wakeups in %.1fs (%.2f/s), %lu slideshow timer runs\n",
+          poll_count, elapsed, elapsed > 0 ? poll_count / elapsed : 0.0,
+          slide_timer_count);
 }
-#endif
+
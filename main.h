@@ -47,14 +47,30 @@ int	to_root_t; /* display on root (tiled) */
 int	to_root_s; /* display on root (stretched) */
 int	transparency; /* transparency on/off */
 gboolean do_assume_files; /* Assume that all images (command line or list) are files, don't stat them. */
+gboolean null_separated; /* File names in -F lists are separated by NULs. */
 gboolean do_grab; /* grab keboard/pointer (default off) */
 gboolean do_omit_load_stat; /* omit the stat(2) system call at load_image time, don't track changes to the file (current_mtime); useful if the thumbnail is much faster */
 gboolean do_enter_command; /* run qiv-command :enter on <Enter> */
 gboolean do_f_commands; /* run qiv-command :f1 etc on <F1> etc. */
 gboolean do_tag_error_pos; /* Move the cursor to tag error reported by qiv-command. */
 gboolean do_copy_link;  /* Create a hard link if possible when copying to .qiv-select */
+int	decoders; /* number of decoder helper processes, 0 to decode in-process */
+int	decoder_mem_limit; /* address space limit of a decoder process in MiB, 0 for unlimited */
+int	cache_mb; /* budget of the compressed decoded image cache in MiB, 0 to disable */
+gboolean do_print_stats; /* print statistics at exit */
+int	shm_cache_mb; /* budget of the cache shared by qiv processes in MiB, 0 to disable */
+gboolean no_render_cache; /* don't use the on-disk cache of shrunk images */
+int	render_cache_mb = 512; /* size limit of the on-disk cache of shrunk images in MiB */
+gboolean do_write_xdg_thumbnails; /* create missing ~/.cache/thumbnails/large/ thumbnails */
+gboolean make_thumbnails; /* create *.th.jpg files and exit */
+int	thumbnail_size = 320; /* maximum width and height of *.th.jpg created */
+gboolean watch_dirs; /* add and remove images as files appear in and disappear from the directories */
+gboolean follow; /* with watch_dirs, show each new image when written */
+gboolean lazy_filter; /* check the contents of files without an image extension only when shown */
+gboolean make_index; /* record the metadata of the images in the index and exit */
+gboolean no_meta_index; /* don't use the on-disk index of image metadata */
+gboolean is_image_names_sorted; /* image_names is in my_strcmp() order */
 gboolean disable_grab; /* disable keyboard/mouse grabbing in fullscreen mode */
-int	max_rand_num; /* the largest random number range we will ask for */
 int	fixed_window_size = 0; /* window width fixed size/off */
 int	fixed_zoom_factor = 0; /* window fixed zoom factor (percentage)/off */
 int zoom_factor = 0; /* zoom factor/off */
@@ -114,6 +130,7 @@ const char *helpstrs[] =
     "jtx<return>          jump to image number x",
     "jfx<return>          jump forward x images",
     "jbx<return>          jump backward x images",
+    "jnname<return>       jump to the image with file name name",
     "enter/return         reset zoom, rotation and color settings",
     "i                    statusbar on/off",
     "I                    iconify window",
@@ -170,40 +187,13 @@ const char *image_extensions[] = {
 #endif
 #ifdef EXTN_TGA
     ".tga",
+#endif
+#ifdef EXTN_WEBP
+    ".webp",
 #endif
     NULL
 };
 
-#ifdef HAVE_MAGIC
-const char *image_magic[] = {
-#ifdef EXTN_JPEG
-  "JPEG image data",
-#endif
-#ifdef EXTN_GIF
-  "GIF image data",
-#endif
-#ifdef EXTN_TIFF
-  "TIFF image data",
-#endif
-#ifdef EXTN_XPM
-  "X pixmap image",
-#endif
-#ifdef EXTN_PNG
-  "PNG image data",
-#endif
-#ifdef EXTN_PGM
-  "Netpbm PBM",
-  "Netpbm PPM",
-#endif
-#ifdef EXTN_BMP
-  "PC bitmap data",
-#endif
-#ifdef EXTN_TGA
-  "Targa image data",
-#endif
- NULL
-};
-#endif
 
 
 #endif /* MAIN_H */
@@ -0,0 +1,220 @@
+/*
+  Module       : makethumb.c
+  Purpose      : Create *.th.jpg thumbnails (qiv --make_thumbnails)
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+/* qiv --make_thumbnails DIR... creates foo.th.jpg for each image foo.* in
+ * the directory trees, as used by --thumbnail. Each thumbnail has a
+ * REALDIMEN:WxH comment with the size of the original image, so qiv
+ * doesn't have to open the original to display its size. Thumbnails newer
+ * than their image are kept.
+ *
+ * Imlib2 isn't thread-safe, so the work is done by forked worker
+ * processes, taking the next image index from a shared counter. JPEG files
+ * are decoded with libjpeg's DCT scaling (1/2, 1/4 or 1/8 size), which is
+ * much faster than a full decode.
+ */
+
+typedef struct {
+  int next_idx;  /* Next index in image_names to process. */
+  int made, up_to_date, failed;
+} make_thumbnails_shared;
+
+#ifdef HAVE_LIBJPEG
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+} thumb_jpeg_error_mgr;
+
+static void thumb_jpeg_error_exit(j_common_ptr cinfo) {
+  longjmp(((thumb_jpeg_error_mgr*)cinfo->err)->setjmp_buffer, 1);
+}
+
+/* Decodes the JPEG file f scaled down by the largest DCT scale factor which
+ * keeps both dimensions at least min_size. Returns NULL if f is not a JPEG
+ * file which libjpeg can decode to RGB.
+ */
+static Imlib_Image load_jpeg_scaled(FILE *f, int min_size, gint *real_w_out, gint *real_h_out) {
+  struct jpeg_decompress_struct cinfo;
+  thumb_jpeg_error_mgr jerr;
+  Imlib_Image im = NULL;
+  DATA32 *volatile pixels = NULL;
+  JSAMPLE *volatile row_buf = NULL;
+  JSAMPROW row;
+  unsigned x, y, denom;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = thumb_jpeg_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(pixels);
+    free(row_buf);
+    return NULL;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, f);
+  jpeg_read_header(&cinfo, TRUE);
+  if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+    jpeg_destroy_decompress(&cinfo);
+    return NULL;  /* Let Imlib2 do the color conversion. */
+  }
+  *real_w_out = cinfo.image_width;
+  *real_h_out = cinfo.image_height;
+  for (denom = 8; denom > 1; denom >>= 1) {
+    if (cinfo.image_width / denom >= (unsigned)min_size &&
+        cinfo.image_height / denom >= (unsigned)min_size) break;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  cinfo.out_color_space = JCS_RGB;
+  cinfo.dct_method = JDCT_IFAST;
+  cinfo.do_fancy_upsampling = FALSE;
+  jpeg_start_decompress(&cinfo);
+  pixels = xmalloc((size_t)cinfo.output_width * cinfo.output_height * sizeof(DATA32));
+  row = row_buf = xmalloc(cinfo.output_width * 3);
+  for (y = 0; y < cinfo.output_height; ++y) {
+    DATA32 *p = pixels + (size_t)y * cinfo.output_width;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    for (x = 0; x < cinfo.output_width; ++x) {
+      p[x] = 0xff000000U | row[3 * x] << 16 | row[3 * x + 1] << 8 | row[3 * x + 2];
+    }
+  }
+  im = imlib_create_image_using_copied_data(
+      cinfo.output_width, cinfo.output_height, pixels);
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  free(row_buf);
+  free(pixels);
+  return im;
+}
+#endif
+
+/* Returns 1 if made, 0 if up to date, -1 on error. */
+static int make_thumbnail(const char *image_name) {
+  char *th_name;
+  struct stat st, th_st;
+  Imlib_Image im = NULL, th_im;
+  gint real_w = -1, real_h = -1, w, h, th_w, th_h;
+  int result = -1;
+
+  if (stat(image_name, &st) != 0 || !S_ISREG(st.st_mode)) return -1;
+  th_name = get_th_jpg_filename(image_name);
+  if (stat(th_name, &th_st) == 0 && th_st.st_mtime >= st.st_mtime) {
+    free(th_name);
+    return 0;
+  }
+#ifdef HAVE_LIBJPEG
+  {
+    FILE *f = fopen(image_name, "rb");
+    if (f) {
+      im = load_jpeg_scaled(f, thumbnail_size, &real_w, &real_h);
+      fclose(f);
+    }
+  }
+#endif
+  if (!im) {
+    if ((im = imlib_load_image_immediately_without_cache(image_name)) == NULL) goto done;
+    imlib_context_set_image(im);
+    real_w = imlib_image_get_width();
+    real_h = imlib_image_get_height();
+  }
+  imlib_context_set_image(im);
+  w = imlib_image_get_width();
+  h = imlib_image_get_height();
+  if (w <= thumbnail_size && h <= thumbnail_size) {
+    th_w = w;
+    th_h = h;
+  } else if (w >= h) {
+    th_w = thumbnail_size;
+    th_h = MAX(1, (gint)((double)h * thumbnail_size / w + 0.5));
+  } else {
+    th_h = thumbnail_size;
+    th_w = MAX(1, (gint)((double)w * thumbnail_size / h + 0.5));
+  }
+  th_im = imlib_create_cropped_scaled_image(0, 0, w, h, th_w, th_h);
+  imlib_free_image();
+  if (!th_im) goto done;
+  imlib_context_set_image(th_im);
+  imlib_image_set_has_alpha(0);
+  if (save_jpeg_with_realdimen(th_name, real_w, real_h, 85) == 0) result = 1;
+  imlib_free_image();
+ done:
+  if (result < 0) fprintf(stderr, "qiv: cannot make thumbnail %s\n", th_name);
+  free(th_name);
+  return result;
+}
+
+static void make_thumbnails_worker(make_thumbnails_shared *shared) {
+  int i, made = 0, up_to_date = 0, failed = 0;
+  imlib_context_set_anti_alias(1);
+  while ((i = __atomic_fetch_add(&shared->next_idx, 1, __ATOMIC_RELAXED)) < images) {
+    switch (make_thumbnail(image_names[i])) {
+     case 1: ++made; break;
+     case 0: ++up_to_date; break;
+     default: ++failed;
+    }
+  }
+  __atomic_add_fetch(&shared->made, made, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shared->up_to_date, up_to_date, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shared->failed, failed, __ATOMIC_RELAXED);
+}
+
+/* Creates the thumbnails of all images in image_names. Returns the exit
+ * code.
+ */
+int make_thumbnail_files(void)
+{
+  make_thumbnails_shared *shared;
+  struct timeval before, after;
+  double elapsed;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN), i;
+  pid_t pid;
+
+  if (workers > images) workers = images;
+  if (workers <= 0) workers = 1;
+  shared = mmap(NULL, sizeof *shared, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("qiv: mmap");
+    return 1;
+  }
+  gettimeofday(&before, 0);
+  for (i = 0; i < workers; ++i) {
+    if ((pid = fork()) == 0) {
+      make_thumbnails_worker(shared);
+      _exit(0);
+    } else if (pid < 0) {
+      perror("qiv: fork");
+      break;
+    }
+  }
+  if (i == 0) make_thumbnails_worker(shared);
+  while (wait(NULL) > 0 || errno == EINTR) {}
+  gettimeofday(&after, 0);
+  elapsed = (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1.0e6;
+  g_print("qiv: %d thumbnails made, %d up to date, %d failed in %.2fs "
+          "(%.1f images/s, %d workers)\n",
+          shared->made, shared->up_to_date, shared->failed, elapsed,
+          elapsed > 0 ? shared->made / elapsed : 0.0, workers);
+  return shared->failed ? 1 : 0;
+}
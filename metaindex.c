@@ -0,0 +1,392 @@
+/*
+  Module       : metaindex.c
+  Purpose      : Persistent index of image metadata (type, size, orientation)
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* For each file seen, qiv remembers whether it's an image, the size of the
+ * image and its EXIF orientation in $XDG_CACHE_HOME/qiv/metaindex (usually
+ * ~/.cache/qiv/metaindex), so next time filter_images() doesn't have to
+ * open files without an image extension, and --thumbnail and --autorotate
+ * don't have to read the image file for its size or EXIF data.
+ *
+ * The index is an array of fixed-size records sorted by (device, inode),
+ * mapped read-only at the first lookup and searched in place, so startup
+ * doesn't depend on its size. A record is used only if the mtime and size
+ * of the file are the same as when it was recorded. New records are kept
+ * in memory, and when there are many of them (and at exit) they are
+ * merged with the file on disk by a background thread, which writes a new
+ * file and renames it over the old one. qiv --index DIR... builds the
+ * index in advance.
+ */
+
+#define META_INDEX_MAGIC "qivmeta1"
+#define META_INDEX_BYTE_ORDER 0x01020304
+/* Written in the background when this many records, and at least 1/4 of
+ * the index, have been added since the last write, so the whole index is
+ * written only a few times even by qiv --index.
+ */
+#define META_INDEX_FLUSH_COUNT 1024
+
+typedef struct {
+  char magic[8];
+  guint32 byte_order;
+  guint32 record_size;
+  guint32 count;
+  guint32 reserved;
+} qiv_meta_header;
+
+typedef struct {
+  guint64 dev, ino;
+  gint64 mtime, size;
+  gint32 w, h;
+  gint8 type, orientation;
+  char reserved[6];
+} qiv_meta_record;
+
+typedef struct {
+  void *map;
+  size_t map_size;
+  const qiv_meta_record *records;
+  guint32 count;
+} qiv_meta_file;
+
+typedef struct {
+  qiv_meta_record *records;
+  guint32 count;
+} qiv_meta_snapshot;
+
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *meta_index_name;
+static gboolean is_opened;
+static qiv_meta_file mapped;  /* As read at the first lookup. */
+static GHashTable *added;  /* Records added since, also the ones written. */
+static unsigned unwritten;  /* Records added since the last write started. */
+static pthread_t writer;
+static gboolean is_writer_started;
+static int is_writer_done;
+static unsigned long meta_hits, meta_misses, meta_puts, meta_writes;
+
+static guint hash_record(gconstpointer p) {
+  const qiv_meta_record *r = (const qiv_meta_record*)p;
+  return (guint)(r->ino ^ (r->ino >> 32) ^ (r->dev * 0x9e3779b9U));
+}
+
+static gboolean equal_records(gconstpointer a, gconstpointer b) {
+  const qiv_meta_record *ra = (const qiv_meta_record*)a;
+  const qiv_meta_record *rb = (const qiv_meta_record*)b;
+  return ra->dev == rb->dev && ra->ino == rb->ino;
+}
+
+static int compare_records(const void *a, const void *b) {
+  const qiv_meta_record *ra = (const qiv_meta_record*)a;
+  const qiv_meta_record *rb = (const qiv_meta_record*)b;
+  if (ra->dev != rb->dev) return ra->dev < rb->dev ? -1 : 1;
+  if (ra->ino != rb->ino) return ra->ino < rb->ino ? -1 : 1;
+  return 0;
+}
+
+/* Maps the index file name. Leaves f empty if it's missing or invalid. */
+static void map_index_file(const char *name, qiv_meta_file *f) {
+  const qiv_meta_header *h;
+  struct stat st;
+  int fd;
+
+  memset(f, 0, sizeof *f);
+  if ((fd = open(name, O_RDONLY | O_CLOEXEC)) < 0) return;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof *h) {
+    f->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (f->map == MAP_FAILED) {
+      f->map = NULL;
+    } else {
+      f->map_size = st.st_size;
+    }
+  }
+  close(fd);
+  if (!f->map) return;
+  h = (const qiv_meta_header*)f->map;
+  if (memcmp(h->magic, META_INDEX_MAGIC, sizeof h->magic) != 0 ||
+      h->byte_order != META_INDEX_BYTE_ORDER ||
+      h->record_size != sizeof(qiv_meta_record) ||
+      f->map_size != sizeof *h + (size_t)h->count * sizeof(qiv_meta_record)) {
+    munmap(f->map, f->map_size);
+    memset(f, 0, sizeof *f);
+    return;
+  }
+  f->records = (const qiv_meta_record*)(h + 1);
+  f->count = h->count;
+}
+
+static void unmap_index_file(qiv_meta_file *f) {
+  if (f->map) munmap(f->map, f->map_size);
+  memset(f, 0, sizeof *f);
+}
+
+/* Called with meta_lock held. Returns FALSE if the index is disabled. */
+static gboolean open_index(void) {
+  char *dir;
+  if (!is_opened) {
+    is_opened = TRUE;
+    if (no_meta_index || (dir = get_xdg_cache_dir("qiv")) == NULL) return FALSE;
+    meta_index_name = g_strdup_printf("%s/metaindex", dir);
+    g_free(dir);
+    map_index_file(meta_index_name, &mapped);
+    added = g_hash_table_new_full(hash_record, equal_records, free, NULL);
+  }
+  return meta_index_name != NULL;
+}
+
+static const qiv_meta_record *find_record(const qiv_meta_file *f, const qiv_meta_record *key) {
+  return (const qiv_meta_record*)bsearch(key, f->records, f->count,
+                                         sizeof *key, compare_records);
+}
+
+/* Called with meta_lock held. Returns the record of the file key is made
+ * from, if it hasn't changed since it was recorded.
+ */
+static const qiv_meta_record *lookup(const qiv_meta_record *key) {
+  const qiv_meta_record *r = g_hash_table_lookup(added, key);
+  if (!r) r = find_record(&mapped, key);
+  return r && r->mtime == key->mtime && r->size == key->size ? r : NULL;
+}
+
+static void set_key(qiv_meta_record *r, const struct stat *st) {
+  memset(r, 0, sizeof *r);
+  r->dev = st->st_dev;
+  r->ino = st->st_ino;
+  r->mtime = st->st_mtime;
+  r->size = st->st_size;
+  r->w = r->h = -1;
+  r->type = META_TYPE_UNKNOWN;
+  r->orientation = -1;
+}
+
+/* Merges the records of the file on disk with the ones in s (which win),
+ * and replaces the file with the result.
+ */
+static void write_index(const qiv_meta_snapshot *s) {
+  qiv_meta_file f;
+  qiv_meta_header h;
+  char *tmp_name = g_strdup_printf("%s.%d.tmp", meta_index_name, (int)getpid());
+  FILE *out;
+  guint32 i = 0, j = 0;
+  int cmp;
+  gboolean is_ok;
+
+  /* Another qiv may have written records since the file was mapped. */
+  map_index_file(meta_index_name, &f);
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, META_INDEX_MAGIC, sizeof h.magic);
+  h.byte_order = META_INDEX_BYTE_ORDER;
+  h.record_size = sizeof(qiv_meta_record);
+  while (i < f.count || j < s->count) {
+    cmp = i == f.count ? 1 : j == s->count ? -1 :
+        compare_records(&f.records[i], &s->records[j]);
+    if (cmp == 0) ++i;
+    if (cmp < 0) ++i; else ++j;
+    ++h.count;
+  }
+  if ((out = fopen(tmp_name, "wb")) == NULL) {
+    fprintf(stderr, "qiv: cannot write %s: %s\n", tmp_name, strerror(errno));
+  } else {
+    is_ok = fwrite(&h, sizeof h, 1, out) == 1;
+    for (i = j = 0; is_ok && (i < f.count || j < s->count);) {
+      cmp = i == f.count ? 1 : j == s->count ? -1 :
+          compare_records(&f.records[i], &s->records[j]);
+      if (cmp == 0) ++i;
+      is_ok = fwrite(cmp < 0 ? &f.records[i++] : &s->records[j++],
+                     sizeof(qiv_meta_record), 1, out) == 1;
+    }
+    if (fclose(out) != 0) is_ok = FALSE;
+    if (!is_ok || rename(tmp_name, meta_index_name) != 0) {
+      fprintf(stderr, "qiv: cannot write %s: %s\n", meta_index_name, strerror(errno));
+      unlink(tmp_name);
+    }
+  }
+  unmap_index_file(&f);
+  g_free(tmp_name);
+}
+
+static void *writer_thread(void *arg) {
+  qiv_meta_snapshot *s = (qiv_meta_snapshot*)arg;
+  write_index(s);
+  free(s->records);
+  free(s);
+  __atomic_store_n(&is_writer_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void copy_record(gpointer key, gpointer value, gpointer user_data) {
+  qiv_meta_snapshot *s = (qiv_meta_snapshot*)user_data;
+  (void)value;
+  s->records[s->count++] = *(qiv_meta_record*)key;
+}
+
+/* Called with meta_lock held. Returns the records added so far, sorted. */
+static qiv_meta_snapshot *take_snapshot(void) {
+  qiv_meta_snapshot *s = (qiv_meta_snapshot*)xmalloc(sizeof *s);
+  s->records = (qiv_meta_record*)xmalloc(
+      (g_hash_table_size(added) + 1) * sizeof *s->records);
+  s->count = 0;
+  g_hash_table_foreach(added, copy_record, s);
+  qsort(s->records, s->count, sizeof *s->records, compare_records);
+  unwritten = 0;
+  ++meta_writes;
+  return s;
+}
+
+/* Called with meta_lock held. */
+static void join_writer(void) {
+  if (is_writer_started) {
+    pthread_join(writer, NULL);
+    is_writer_started = FALSE;
+  }
+}
+
+/* Sets m to all fields unknown. */
+void meta_init(qiv_meta *m)
+{
+  m->w = m->h = -1;
+  m->type = META_TYPE_UNKNOWN;
+  m->orientation = -1;
+}
+
+/* Fills m with what is known about the file with stat st. Returns 0 if
+ * nothing is. Can be called by any thread.
+ */
+int meta_index_get(const struct stat *st, qiv_meta *m)
+{
+  qiv_meta_record key;
+  const qiv_meta_record *r = NULL;
+
+  meta_init(m);
+  set_key(&key, st);
+  pthread_mutex_lock(&meta_lock);
+  if (open_index() && (r = lookup(&key)) != NULL) {
+    m->w = r->w;
+    m->h = r->h;
+    m->type = r->type;
+    m->orientation = r->orientation;
+    ++meta_hits;
+  } else {
+    ++meta_misses;
+  }
+  pthread_mutex_unlock(&meta_lock);
+  return r != NULL;
+}
+
+/* Records the known fields of m for the file with stat st, keeping what
+ * was known about it before. Can be called by any thread.
+ */
+void meta_index_put(const struct stat *st, const qiv_meta *m)
+{
+  qiv_meta_record key, *r;
+  const qiv_meta_record *old;
+
+  set_key(&key, st);
+  pthread_mutex_lock(&meta_lock);
+  if (!open_index()) goto done;
+  if ((old = lookup(&key)) != NULL) key = *old;
+  if (m->w >= 0) {
+    key.w = m->w;
+    key.h = m->h;
+  }
+  if (m->type != META_TYPE_UNKNOWN) key.type = m->type;
+  if (m->orientation >= 0) key.orientation = m->orientation;
+  if (old && 0 == memcmp(old, &key, sizeof key)) goto done;
+  r = (qiv_meta_record*)xmalloc(sizeof *r);
+  *r = key;
+  g_hash_table_replace(added, r, r);
+  ++meta_puts;
+  if (++unwritten >= META_INDEX_FLUSH_COUNT &&
+      unwritten >= (mapped.count + g_hash_table_size(added)) / 4) {
+    if (is_writer_started && __atomic_load_n(&is_writer_done, __ATOMIC_ACQUIRE))
+      join_writer();
+    if (!is_writer_started) {
+      is_writer_done = 0;
+      is_writer_started =
+          pthread_create(&writer, NULL, writer_thread, take_snapshot()) == 0;
+    }
+  }
+ done:
+  pthread_mutex_unlock(&meta_lock);
+}
+
+/* Writes the records added to the index file. To be called at exit. */
+void meta_index_save(void)
+{
+  qiv_meta_snapshot *s;
+  pthread_mutex_lock(&meta_lock);
+  join_writer();
+  if (meta_index_name && unwritten) {
+    s = take_snapshot();
+    write_index(s);
+    free(s->records);
+    free(s);
+  }
+  pthread_mutex_unlock(&meta_lock);
+}
+
+/* qiv --index: records the metadata of the images not in the index yet,
+ * and writes the index. Called after filter_images(), which records the
+ * files which are not images.
+ */
+int meta_index_build(void)
+{
+  struct timeval before, after;
+  struct stat st;
+  qiv_meta m;
+  double elapsed;
+  int i, indexed = 0, up_to_date = 0, failed = 0;
+
+  gettimeofday(&before, 0);
+  for (i = 0; i < images; ++i) {
+    if (stat_cache_stat(image_names[i], &st, TRUE) != 0 || !S_ISREG(st.st_mode)) {
+      ++failed;
+      continue;
+    }
+    if (meta_index_get(&st, &m) && m.w >= 0
+#ifdef HAVE_EXIF
+        && m.orientation >= 0
+#endif
+        ) {
+      ++up_to_date;
+      continue;
+    }
+    get_image_meta(image_names[i], &m);
+    if (m.w < 0) ++failed; else ++indexed;
+    meta_index_put(&st, &m);
+  }
+  meta_index_save();
+  gettimeofday(&after, 0);
+  elapsed = (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1.0e6;
+  g_print("qiv: %d images indexed, %d up to date, %d failed in %.2fs "
+          "(%.1f images/s)\n",
+          indexed, up_to_date, failed, elapsed,
+          elapsed > 0 ? indexed / elapsed : 0.0);
+  return failed || !meta_index_name ? 1 : 0;
+}
+
+void meta_index_print_stats(void)
+{
+  if (!meta_hits && !meta_misses && !meta_puts) return;
+  g_print("meta index: %u records on disk, %lu hits, %lu misses, "
+          "%lu records added, %lu writes\n",
+          mapped.count, meta_hits, meta_misses, meta_puts, meta_writes);
+}
@@ -0,0 +1,306 @@
+/*
+  Module       : nameindex.c
+  Purpose      : Indexes of image_names for navigation
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <string.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* The images of a directory are next to each other in image_names (as
+ * read by rreaddir(), or sorted), so the list is indexed as runs of images
+ * with the same directory. Jumping to the next directory (Ctrl-Space) looks
+ * at one image per run instead of all of them.
+ *
+ * Names are found (--browse, jn<name>, --watch_dirs events) in a hash
+ * table from the name to its index in image_names.
+ *
+ * The indexes are built when first needed, and dropped by
+ * name_index_invalidate(), which must be called whenever image_names
+ * changes (reordered images, or many added or removed at once). Single
+ * images added, removed or renamed are reported by name_index_add(),
+ * name_index_remove() and name_index_rename() instead, which update both
+ * indexes in place: the runs after the image are moved by one, and a run
+ * is only added or dropped at the image itself. Removing a run can leave
+ * two runs of the same directory next to each other, which is harmless.
+ * The hash table keeps the index of each name as of a number of images
+ * added or removed (shifts), which are logged, and an index found is moved
+ * by the shifts logged after it. The table is rebuilt when the log gets
+ * long.
+ */
+
+static gboolean is_valid;
+/* Index of the first image of each run, and images after the last one. */
+static int *dir_starts;
+static int dir_count, dir_cap;
+/* Name (not owned, pointing to image_names) -> index in name_poss + 1. Only
+ * the first of duplicate names is in it.
+ */
+static GHashTable *name_idxs;
+static gboolean has_duplicates;
+typedef struct {
+  int idx;  /* In image_names, ... */
+  int shift_count;  /* ... after this many shifts. */
+} qiv_name_pos;
+static qiv_name_pos *name_poss;
+static int name_pos_count, name_pos_cap;
+/* Images added (delta 1) or removed (delta -1) at idx, since the table was
+ * built.
+ */
+typedef struct {
+  int idx, delta;
+} qiv_shift;
+static qiv_shift *shifts;
+static int shift_count, shift_cap;
+static unsigned long find_count, table_builds;
+
+/* Rebuild the table after this many shifts. */
+#define MAX_SHIFTS(n) (1024 + (n) / 16)
+
+static void drop_name_idxs(void) {
+  g_hash_table_destroy(name_idxs);
+  name_idxs = NULL;
+}
+
+void name_index_invalidate(void)
+{
+  is_valid = FALSE;
+  if (name_idxs) drop_name_idxs();
+}
+
+/* Returns the length of the directory part of name, including the '/'. */
+static size_t get_dir_len(const char *name) {
+  const char *slash = strrchr(name, '/');
+  return slash ? (size_t)(slash - name + 1) : 0;
+}
+
+static gboolean is_same_dir(const char *a, const char *b) {
+  size_t len = get_dir_len(a);
+  return len == get_dir_len(b) && 0 == memcmp(a, b, len);
+}
+
+static void add_dir_start(int idx) {
+  if (dir_count == dir_cap) {
+    dir_cap = dir_cap ? dir_cap * 2 : 1024;
+    dir_starts = (int*)xrealloc(dir_starts, (dir_cap + 1) * sizeof *dir_starts);
+  }
+  dir_starts[dir_count++] = idx;
+}
+
+static void build_index(void) {
+  int i;
+
+  dir_count = 0;
+  if (!dir_starts) {
+    dir_cap = 1024;
+    dir_starts = (int*)xmalloc((dir_cap + 1) * sizeof *dir_starts);
+  }
+  for (i = 0; i < images; ++i) {
+    if (i == 0 || !is_same_dir(image_names[i], image_names[i - 1]))
+      add_dir_start(i);
+  }
+  dir_starts[dir_count] = images;
+  is_valid = TRUE;
+}
+
+/* Returns the index of the run containing image idx. */
+static int find_dir_run(int idx) {
+  int lo = 0, hi = dir_count - 1, mid;
+  while (lo < hi) {  /* The last run starting at or before idx. */
+    mid = lo + (hi - lo + 1) / 2;
+    if (dir_starts[mid] <= idx)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/* Makes idx the start of run r, moving the runs from r up. */
+static void insert_dir_start(int r, int idx) {
+  if (dir_count == dir_cap) {
+    dir_cap *= 2;
+    dir_starts = (int*)xrealloc(dir_starts, (dir_cap + 1) * sizeof *dir_starts);
+  }
+  memmove(dir_starts + r + 1, dir_starts + r, (dir_count + 1 - r) * sizeof *dir_starts);
+  dir_starts[r] = idx;
+  ++dir_count;
+}
+
+static void remove_dir_start(int r) {
+  memmove(dir_starts + r, dir_starts + r + 1, (dir_count - r) * sizeof *dir_starts);
+  --dir_count;
+}
+
+/* Updates the runs for image idx, just inserted to image_names. */
+static void insert_into_runs(int idx) {
+  int r;
+  for (r = dir_count; r >= 0 && dir_starts[r] >= idx; --r)
+    ++dir_starts[r];
+  /* In the middle or at the end of the run of idx - 1. */
+  if (idx > 0 && is_same_dir(image_names[idx], image_names[idx - 1])) return;
+  r = idx > 0 ? find_dir_run(idx - 1) + 1 : 0;
+  if (r < dir_count && dir_starts[r] == idx + 1 &&
+      is_same_dir(image_names[idx], image_names[idx + 1])) {
+    dir_starts[r] = idx;  /* At the start of the next run. */
+    return;
+  }
+  insert_dir_start(r, idx);
+  if (idx + 1 < images && dir_starts[r + 1] != idx + 1)
+    insert_dir_start(r + 1, idx + 1);  /* Splits the run of idx - 1. */
+}
+
+/* Updates the runs for image idx, about to be removed from image_names. */
+static void remove_from_runs(int idx) {
+  int r = find_dir_run(idx);
+  if (dir_starts[r] == idx && dir_starts[r + 1] == idx + 1)
+    remove_dir_start(r);  /* The only image of its run. */
+  for (r = dir_count; r >= 0 && dir_starts[r] > idx; --r)
+    --dir_starts[r];
+}
+
+/* Returns the first image after idx (the last one before idx if direction
+ * is negative) which is not in the directory of idx or its subdirectories,
+ * wrapping around, or idx if there is none.
+ */
+int name_index_next_dir(int idx, int direction)
+{
+  const char *p = image_names[idx];
+  size_t prefix_size = get_dir_len(p);
+  int old_run, run, cand;
+
+  if (!is_valid) build_index();
+  if (dir_count < 2) return idx;
+  old_run = run = find_dir_run(idx);
+  for (;;) {
+    /* All images of a run are either in the directory of idx, or not. */
+    if (direction < 0) {
+      cand = dir_starts[run] > 0 ? dir_starts[run] - 1 : images - 1;
+      run = find_dir_run(cand);
+    } else {
+      run = (run + 1) % dir_count;
+      cand = dir_starts[run];
+    }
+    if (run == old_run) return idx;
+    if (0 != strncmp(image_names[cand], p, prefix_size)) return cand;
+  }
+}
+
+/* Adds image_names[idx] to the table. */
+static void add_name(int idx) {
+  qiv_name_pos *pos;
+  if (g_hash_table_lookup(name_idxs, image_names[idx])) {
+    has_duplicates = TRUE;
+    return;
+  }
+  if (name_pos_count == name_pos_cap) {
+    name_pos_cap = name_pos_cap ? name_pos_cap * 2 : 1024;
+    name_poss = (qiv_name_pos*)xrealloc(name_poss, name_pos_cap * sizeof *name_poss);
+  }
+  pos = name_poss + name_pos_count++;
+  pos->idx = idx;
+  pos->shift_count = shift_count;
+  g_hash_table_insert(name_idxs, image_names[idx], GINT_TO_POINTER(name_pos_count));
+}
+
+static void build_name_idxs(void) {
+  int i;
+  if (name_idxs) g_hash_table_destroy(name_idxs);
+  name_idxs = g_hash_table_new(g_str_hash, g_str_equal);
+  has_duplicates = FALSE;
+  name_pos_count = shift_count = 0;
+  ++table_builds;
+  for (i = 0; i < images; ++i) {  /* The first duplicate wins. */
+    add_name(i);
+  }
+}
+
+/* Returns the index of name in image_names according to the table, or -1. */
+static int lookup_name(const char *name) {
+  int i = GPOINTER_TO_INT(g_hash_table_lookup(name_idxs, name)) - 1;
+  qiv_name_pos *pos;
+  const qiv_shift *shift;
+  if (i < 0) return -1;
+  pos = name_poss + i;
+  for (; pos->shift_count < shift_count; ++pos->shift_count) {
+    shift = shifts + pos->shift_count;
+    if (shift->delta > 0 ? pos->idx >= shift->idx : pos->idx > shift->idx)
+      pos->idx += shift->delta;
+  }
+  return pos->idx;
+}
+
+static void add_shift(int idx, int delta) {
+  if (shift_count >= MAX_SHIFTS(images)) {
+    drop_name_idxs();  /* Rebuilt by the next name_index_find(). */
+    return;
+  }
+  if (shift_count == shift_cap) {
+    shift_cap = shift_cap ? shift_cap * 2 : 1024;
+    shifts = (qiv_shift*)xrealloc(shifts, shift_cap * sizeof *shifts);
+  }
+  shifts[shift_count].idx = idx;
+  shifts[shift_count].delta = delta;
+  ++shift_count;
+}
+
+/* Returns the index of name in image_names, or -1. */
+int name_index_find(const char *name)
+{
+  int idx;
+  ++find_count;
+  if (!name_idxs) build_name_idxs();
+  idx = lookup_name(name);
+  if (idx < 0 || (idx < images && 0 == strcmp(image_names[idx], name)))
+    return idx;
+  build_name_idxs();  /* Unexpected. */
+  return lookup_name(name);
+}
+
+/* To be called after image_names[idx] is inserted. */
+void name_index_add(int idx)
+{
+  if (is_valid) insert_into_runs(idx);
+  if (name_idxs) add_shift(idx, 1);
+  if (name_idxs) add_name(idx);
+}
+
+/* Removes name (at idx) from the table. */
+static void remove_name(const char *name, int idx) {
+  if (lookup_name(name) != idx) return;
+  if (has_duplicates) {  /* The next one with the same name is not in it. */
+    drop_name_idxs();
+  } else {
+    g_hash_table_remove(name_idxs, name);
+  }
+}
+
+/* To be called before image_names[idx] is removed. */
+void name_index_remove(int idx)
+{
+  if (is_valid) remove_from_runs(idx);
+  if (name_idxs) remove_name(image_names[idx], idx);
+  if (name_idxs) add_shift(idx, -1);
+}
+
+/* To be called after image_names[idx] is changed from old_name. */
+void name_index_rename(int idx, const char *old_name)
+{
+  if (is_valid && !is_same_dir(image_names[idx], old_name)) {
+    remove_from_runs(idx);
+    insert_into_runs(idx);
+  }
+  if (name_idxs) remove_name(old_name, idx);
+  if (name_idxs) add_name(idx);
+}
+
+void name_index_print_stats(void)
+{
+  if (!find_count) return;
+  g_print("name index: %lu names found, table built %lu times\n",
+          find_count, table_builds);
+}
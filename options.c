@@ -8,7 +8,6 @@
 
 #include "qiv.h"
 #include <string.h>
-#include <ctype.h>
 #include <errno.h>
 #include <sys/stat.h>
 #include <stdio.h>
@@ -23,7 +22,7 @@
 extern char *optarg;
 extern int optind, opterr, optopt;
 
-static char *short_options = "ab:c:d:efg:hijlmno:prstuvw:xyzA:BDF:GIMNPRSTW:X:";
+static char *short_options = "0ab:c:d:efg:hijlmno:prstuvw:xyzA:BDF:GIMNPRSTW:X:";
 static struct option long_options[] =
 {
     {"do_assume_files",  0, NULL, QIV_FLAG_DO_ASSUME_FILES},
@@ -33,6 +32,21 @@ static struct option long_options[] =
     {"do_omit_load_stat",0, NULL, QIV_FLAG_DO_OMIT_LOAD_STAT},
     {"do_tag_error_pos", 0, NULL, QIV_FLAG_DO_TAG_ERROR_POS},
     {"do_copy_link",     0, NULL, QIV_FLAG_DO_COPY_LINK},
+    {"decoders",         1, NULL, QIV_FLAG_DECODERS},
+    {"decoder_mem_limit",1, NULL, QIV_FLAG_DECODER_MEM_LIMIT},
+    {"cache_mb",         1, NULL, QIV_FLAG_CACHE_MB},
+    {"stats",            0, NULL, QIV_FLAG_STATS},
+    {"shm_cache",        1, NULL, QIV_FLAG_SHM_CACHE},
+    {"no_render_cache",  0, NULL, QIV_FLAG_NO_RENDER_CACHE},
+    {"render_cache_mb",  1, NULL, QIV_FLAG_RENDER_CACHE_MB},
+    {"do_write_xdg_thumbnails", 0, NULL, QIV_FLAG_DO_WRITE_XDG_THUMBNAILS},
+    {"make_thumbnails",  0, NULL, QIV_FLAG_MAKE_THUMBNAILS},
+    {"thumbnail_size",   1, NULL, QIV_FLAG_THUMBNAIL_SIZE},
+    {"watch_dirs",       0, NULL, QIV_FLAG_WATCH_DIRS},
+    {"follow",           0, NULL, QIV_FLAG_FOLLOW},
+    {"lazy_filter",      0, NULL, QIV_FLAG_LAZY_FILTER},
+    {"index",            0, NULL, QIV_FLAG_MAKE_INDEX},
+    {"no_meta_index",    0, NULL, QIV_FLAG_NO_META_INDEX},
     {"brightness",       1, NULL, 'b'},
     {"contrast",         1, NULL, 'c'},
     {"delay",            1, NULL, 'd'},
@@ -60,6 +74,7 @@ static struct option long_options[] =
     {"browse",           0, NULL, 'B'},
     {"no_sort",          0, NULL, 'D'},
     {"file",             1, NULL, 'F'},
+    {"null",             0, NULL, '0'},
     {"disable_grab",     0, NULL, 'G'},
     {"statusbar",        0, NULL, 'I'},
     {"merged_case_sort", 0, NULL, 'M'},
@@ -73,136 +88,15 @@ static struct option long_options[] =
     {0,                  0, NULL, 0}
 };
 
-static int numeric_sort = 0, merged_case_sort = 0, ignore_path_sort = 0;
+int numeric_sort = 0, merged_case_sort = 0, ignore_path_sort = 0;
 int thumbnail = 0;
 
-/* This array makes it easy to sort filenames into merged-case order
- * (e.g. AaBbCcDdEeFf...). */
-static unsigned char casemap[256] = {
-    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,
-    0x08,0x09,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,
-    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,
-    0x18,0x19,0x1A,0x1B,0x1C,0x1D,0x1E,0x1F,
-    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,
-    0x28,0x29,0x2A,0x2B,0x2C,0x2D,0x2E,0x2F,
-    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,
-    0x38,0x39,0x3A,0x3B,0x3C,0x3D,0x3E,0x3F,
-    0x40,0x41,0x43,0x45,0x47,0x49,0x4B,0x4D, /* @ABCDEFG */
-    0x4F,0x51,0x53,0x55,0x57,0x59,0x5B,0x5D, /* HIJKLMNO */
-    0x5F,0x61,0x63,0x65,0x67,0x69,0x6B,0x6D, /* PQRSTUVW */
-    0x6F,0x71,0x73,0x75,0x76,0x77,0x78,0x79, /* XYZ[\]^_ */
-    0x7A,0x42,0x44,0x46,0x48,0x4A,0x4C,0x4E, /* `abcdefg */
-    0x50,0x52,0x54,0x56,0x58,0x5A,0x5C,0x5E, /* hijklmno */
-    0x60,0x62,0x64,0x66,0x68,0x6A,0x6C,0x6E, /* pqrstuvw */
-    0x70,0x72,0x74,0x7B,0x7C,0x7D,0x7E,0x7F, /* xyz{|}~  */
-    0x80,0x81,0x82,0x83,0x84,0x85,0x86,0x87,
-    0x88,0x89,0x8A,0x8B,0x8C,0x8D,0x8E,0x8F,
-    0x90,0x91,0x92,0x93,0x94,0x95,0x96,0x97,
-    0x98,0x99,0x9A,0x9B,0x9C,0x9D,0x9E,0x9F,
-    0xA0,0xA1,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,
-    0xA8,0xA9,0xAA,0xAB,0xAC,0xAD,0xAE,0xAF,
-    0xB0,0xB1,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,
-    0xB8,0xB9,0xBA,0xBB,0xBC,0xBD,0xBE,0xBF,
-    0xC0,0xC1,0xC2,0xC3,0xC4,0xC5,0xC6,0xC7,
-    0xC8,0xC9,0xCA,0xCB,0xCC,0xCD,0xCE,0xCF,
-    0xD0,0xD1,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,
-    0xD8,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,0xDF,
-    0xE0,0xE1,0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,
-    0xE8,0xE9,0xEA,0xEB,0xEC,0xED,0xEE,0xEF,
-    0xF0,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,
-    0xF8,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
-};
-
-static int my_strcmp(const void *v1, const void *v2)
-{
-    unsigned char *cp1 = *(unsigned char **)v1;
-    unsigned char *cp2 = *(unsigned char **)v2;
-    unsigned char *sufptr1, *sufptr2;
-    int tmp;
-
-    sufptr1 = cp1 + strlen((char *)cp1);
-    while (--sufptr1 > cp1 && *sufptr1 != '.') {}
-    sufptr2 = cp2 + strlen((char *)cp2);
-    while (--sufptr2 > cp2 && *sufptr2 != '.') {}
-
-    if (ignore_path_sort) {
-        unsigned char *slash;
-        if ((slash = (unsigned char *)strrchr((char *)cp1, '/')) != NULL)
-            cp1 = slash + 1;
-        if ((slash = (unsigned char *)strrchr((char *)cp2, '/')) != NULL)
-            cp2 = slash + 1;
-    }
-    if (numeric_sort) {
-        int namelen = 0, diff = 0;
-
-        do {
-            if (sufptr1 && (isdigit(*cp1) || isdigit(*cp2))) {
-                unsigned char *ep1, *ep2;
-
-                if (diff)
-                    return diff;
-                for (ep1 = cp1; isdigit(*ep1); ep1++) {}
-                if (ep1 == cp1)
-                    return 1;
-                for (ep2 = cp2; isdigit(*ep2); ep2++) {}
-                if (cp2 == ep2)
-                    return -1;
-                if ((diff = (ep1 - cp1) - (ep2 - cp2)) == 0) {
-                    long val = atol((char *)cp1) - atol((char *)cp2);
-                    diff = val < 0? -1 : val > 0? 1 : 0;
-                }
-                if (diff && sufptr1 - cp1 <= namelen &&
-                    sufptr2 - cp2 <= namelen)
-                    return diff;
-                namelen += ep1 - cp1;
-                cp1 = ep1;
-                cp2 = ep2 - 1;
-            }
-            else {
-                if (cp1 == sufptr1) {
-                    if (cp2 != sufptr2)
-                        return -1;
-                    sufptr1 = sufptr2 = NULL;
-                }
-                else if (cp2 == sufptr2)
-                    return 1;
-                if (merged_case_sort)
-                    tmp = casemap[*cp1++] - casemap[*cp2];
-                else
-                    tmp = *cp1++ - *cp2;
-                if (tmp != 0)
-                    return tmp;
-                if (*cp2 == '/')
-                    namelen = 0;
-                else
-                    namelen++;
-            }
-        } while (*cp2++ != '\0');
-        return diff;
-    }
-
-    do {
-        if (cp1 == sufptr1) {
-            if (cp2 != sufptr2)
-                return -1;
-        }
-        else if (cp2 == sufptr2)
-            return 1;
-        if (merged_case_sort)
-            tmp = casemap[*cp1++] - casemap[*cp2];
-        else
-            tmp = *cp1++ - *cp2;
-        if (tmp != 0)
-            return tmp;
-    } while (*cp2++ != '\0');
-
-    return 0;
-}
-
 void options_read(int argc, char **argv, qiv_image *q)
 {
-  int long_index, shuffle = 0, need_sort = 1;
-  int c, cnt;
+  int long_index, shuffle = 0, need_sort = 1, is_background_scan;
+  int c, cnt, i;
+  char **list_files = NULL;
+  int list_file_count = 0;
   int force_statusbar=-1;             /* default is don't force */
   struct stat sb;
 
@@ -223,6 +117,49 @@ void options_read(int argc, char **argv, qiv_image *q)
                 break;
             case QIV_FLAG_DO_COPY_LINK: do_copy_link=1;
                 break;
+            case QIV_FLAG_DECODERS: decoders = checked_atoi(optarg);
+                if (decoders < 0) usage(argv[0],1);
+                break;
+            case QIV_FLAG_DECODER_MEM_LIMIT: decoder_mem_limit = checked_atoi(optarg);
+                break;
+            case QIV_FLAG_CACHE_MB: cache_mb = checked_atoi(optarg);
+                if (cache_mb < 0) usage(argv[0],1);
+#ifndef HAVE_LZ4
+                if (cache_mb) g_print("qiv: compiled without LZ4, --cache_mb ignored\n");
+                cache_mb = 0;
+#endif
+                break;
+            case QIV_FLAG_STATS: do_print_stats=1;
+                break;
+            case QIV_FLAG_SHM_CACHE: shm_cache_mb = checked_atoi(optarg);
+                if (shm_cache_mb < 0) usage(argv[0],1);
+                break;
+            case QIV_FLAG_NO_RENDER_CACHE: no_render_cache=1;
+                break;
+            case QIV_FLAG_RENDER_CACHE_MB: render_cache_mb = checked_atoi(optarg);
+                if (render_cache_mb < 0) usage(argv[0],1);
+                break;
+            case QIV_FLAG_DO_WRITE_XDG_THUMBNAILS: do_write_xdg_thumbnails=1;
+                break;
+            case QIV_FLAG_MAKE_THUMBNAILS: make_thumbnails=1;
+                recursive=1;
+                thumbnail=1;  /* Don't make thumbnails of thumbnails. */
+                break;
+            case QIV_FLAG_THUMBNAIL_SIZE: thumbnail_size = checked_atoi(optarg);
+                if (thumbnail_size <= 0) usage(argv[0],1);
+                break;
+            case QIV_FLAG_WATCH_DIRS: watch_dirs=1;
+                break;
+            case QIV_FLAG_FOLLOW: follow=1;
+                watch_dirs=1;
+                break;
+            case QIV_FLAG_LAZY_FILTER: lazy_filter=1;
+                break;
+            case QIV_FLAG_MAKE_INDEX: make_index=1;
+                recursive=1;
+                break;
+            case QIV_FLAG_NO_META_INDEX: no_meta_index=1;
+                break;
             case 'b': q->mod.brightness = (checked_atoi(optarg)+32)*8;
                 if ((q->mod.brightness<0) || (q->mod.brightness>512))
                     usage(argv[0],1);
@@ -288,10 +225,11 @@ void options_read(int argc, char **argv, qiv_image *q)
                 break;
             case 'D': need_sort = 0;
                 break;
-            case 'F': if(rreadfile(optarg) < 0) {
-                  g_print("Error: %s could not be opened: %s.\n",optarg, strerror(errno));
-                  gdk_exit(1);
-                }
+            case 'F': list_files = (char**)xrealloc(list_files,
+                                          (list_file_count+1)*sizeof(char*));
+                list_files[list_file_count++] = optarg;
+                break;
+            case '0': null_separated=1;
                 break;
             case 'G': disable_grab=1;
                 break;
@@ -324,6 +262,26 @@ void options_read(int argc, char **argv, qiv_image *q)
 
     /* In case user specified -D and -P, -M, or -N */
     need_sort = need_sort | ignore_path_sort | merged_case_sort | numeric_sort;
+    /* Read directories in the background if the order of the images found
+     * doesn't matter (they will be sorted) and all are not needed at once.
+     */
+    is_background_scan = need_sort && !browse && !random_order && !make_thumbnails &&
+        !make_index;
+
+    /* Read the lists now that all options (-0, --do_assume_files) are
+     * known. The last list may be read while the first images are shown,
+     * unless names following it would have to come after it.
+     */
+    for (i = 0; i < list_file_count; ++i) {
+        gboolean is_streamed = i == list_file_count - 1 &&
+            (need_sort || optind == argc) &&
+            !browse && !random_order && !shuffle && !make_thumbnails && !make_index;
+        if (rreadfile(list_files[i], is_streamed) < 0) {
+            g_print("Error: %s could not be opened: %s.\n",list_files[i], strerror(errno));
+            gdk_exit(1);
+        }
+    }
+    free(list_files);
 
     /* default: show statusbar only in fullscreen mode */
     /* user wants to override? */
@@ -336,10 +294,15 @@ void options_read(int argc, char **argv, qiv_image *q)
             max_image_cnt = 8192;
             image_names = (char**)xmalloc(max_image_cnt * sizeof(char*));
         }
+        if (!do_assume_files)
+            stat_cache_fill(argv + optind, cnt);
         while (cnt-- > 0) {
             if (!do_assume_files &&
-                stat(argv[optind], &sb) >= 0 && S_ISDIR(sb.st_mode)) {
-                rreaddir(argv[optind++],recursive);
+                stat_cache_stat(argv[optind], &sb, FALSE) >= 0 && S_ISDIR(sb.st_mode)) {
+                if (is_background_scan)
+                    scan_background_add(argv[optind++],recursive);
+                else
+                    rreaddir(argv[optind++],recursive);
             }
             else {
                 if (images >= max_image_cnt) {
@@ -366,28 +329,24 @@ void options_read(int argc, char **argv, qiv_image *q)
         images = j;
     }
 
-    if(shuffle) {
-        char *fn;
-        int i, p;
-        for (i=0;i<images;i++) { /* simple insertion sort, fine for small num */
-          p = (int)(((float)rand()/RAND_MAX) * (images-i)) + i;
-          fn = image_names[i];
-          image_names[i] = image_names[p];
-          image_names[p] = fn;
-        }
-    }
+    if(shuffle)
+        shuffle_names(image_names, images);
 
     if (need_sort) {
         if (browse) {
             char *tmp = (char *)xmalloc(strlen(image_names[0])+1);
+            int insert_idx;
             strcpy(tmp,image_names[0]);
             rreaddir(dirname(image_names[0]),0);
-            qsort(image_names, images, sizeof *image_names, my_strcmp);
-            image_idx = find_image(images,image_names,tmp);
+            sort_names(image_names, images);
+            if ((image_idx = find_sorted_name(image_names, images, tmp, &insert_idx)) < 0)
+                image_idx = 0;
             free(tmp);
         } else {
-            qsort(image_names, images, sizeof *image_names, my_strcmp);
+            sort_names(image_names, images);
         }
+        is_image_names_sorted = 1;
+        if (is_background_scan) scan_background_start();
     } else if (browse) {
         rreaddir(dirname(image_names[0]),0);
     }
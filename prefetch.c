@@ -0,0 +1,196 @@
+/*
+  Module       : prefetch.c
+  Purpose      : Plan which images to decode in the background
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "qiv.h"
+
+/* With --decoders, the helper processes not busy with the image shown
+ * decode the images most likely to be shown next. Each way of moving to
+ * another image (space, PgDn, jf10, Ctrl-Space, random order, slideshow)
+ * is a navigation mode, which is told about each move (prefetch_note_nav()),
+ * and proposes the images it would move to next. Modes used recently
+ * weigh more, so after a few PgDn presses the image 5 ahead is decoded
+ * before the next one.
+ *
+ * The budget is the number of decoders but one (kept for the image the
+ * user asks for), and candidates much less likely than the others are not
+ * decoded at all, to save CPU time.
+ */
+
+/* Weights of the modes are multiplied by this at each move. */
+#define PREFETCH_DECAY 0.75
+/* Candidates with less than this share of the total weight are dropped. */
+#define PREFETCH_MIN_SHARE 0.1
+#define PREFETCH_MAX_CANDIDATES 16
+
+typedef struct {
+  int idx;
+  double weight;  /* Sum of the weights of the modes proposing it. */
+} qiv_prefetch_candidate;
+
+static const char *const mode_names[NAV_COUNT] = {
+  "next", "page", "jump", "directory", "random", "slideshow"
+};
+static double mode_weights[NAV_COUNT] = {1.0};
+/* Delta of the last move of each mode (0 after jt), only its sign for the
+ * modes moving by one.
+ */
+static int mode_deltas[NAV_COUNT] = {1, 5, 0, 1, 1, 1};
+static int nav_mode = -1;  /* Of the move to the image being loaded. */
+static char *planned[PREFETCH_MAX_CANDIDATES];  /* Names prefetched. */
+static int planned_count;
+static unsigned long nav_loads[NAV_COUNT], nav_hits[NAV_COUNT];
+
+/* To be called when image_idx is changed by navigation mode (NAV_...),
+ * with the amount (negative backward) it was moved by.
+ */
+void prefetch_note_nav(int mode, int delta)
+{
+  int i;
+  if (random_order && (mode == NAV_NEXT || mode == NAV_PAGE || mode == NAV_SLIDESHOW))
+    mode = NAV_RANDOM;  /* next_image() moves in the random order. */
+  for (i = 0; i < NAV_COUNT; ++i) mode_weights[i] *= PREFETCH_DECAY;
+  mode_weights[mode] += 1.0;
+  if (mode != NAV_JUMP && mode != NAV_PAGE) delta = delta < 0 ? -1 : 1;
+  mode_deltas[mode] = delta;
+  nav_mode = mode;
+}
+
+static int wrap_idx(int idx) {
+  idx %= images;
+  return idx < 0 ? idx + images : idx;
+}
+
+static int add_candidate(qiv_prefetch_candidate *cands, int count, int idx, double weight) {
+  int i;
+  if (idx == image_idx) return count;
+  for (i = 0; i < count; ++i) {
+    if (cands[i].idx == idx) {
+      cands[i].weight += weight;
+      return count;
+    }
+  }
+  if (count == PREFETCH_MAX_CANDIDATES) return count;
+  cands[count].idx = idx;
+  cands[count].weight = weight;
+  return count + 1;
+}
+
+static double get_mode_weight(int mode) {
+  if (slide) return mode == NAV_SLIDESHOW || mode == NAV_RANDOM ? 1.0 : 0.0;
+  return mode_weights[mode];
+}
+
+/* Adds the images the modes would move to next (the second image ahead
+ * with half the weight) to cands. Returns their number. In a slideshow,
+ * only the slideshow is asked. Modes whose candidates would be dropped
+ * anyway are not asked, e.g. Ctrl-Space (a lookup in the directory runs)
+ * long after it was last used.
+ */
+static int propose(qiv_prefetch_candidate *cands) {
+  int count = 0, mode, dir, target;
+  double w, total = 0;
+  for (mode = 0; mode < NAV_COUNT; ++mode) total += get_mode_weight(mode);
+  for (mode = 0; mode < NAV_COUNT; ++mode) {
+    w = get_mode_weight(mode);
+    if (w <= 0 || w < PREFETCH_MIN_SHARE * total) continue;
+    switch (mode) {
+     case NAV_NEXT:
+     case NAV_SLIDESHOW:  /* Goes on in the last direction. */
+      if (random_order) break;
+      dir = mode == NAV_NEXT ? mode_deltas[mode] : set_image_direction(0);
+      count = add_candidate(cands, count, wrap_idx(image_idx + dir), w);
+      count = add_candidate(cands, count, wrap_idx(image_idx + 2 * dir), w / 2);
+      break;
+     case NAV_PAGE:
+      if (random_order) break;
+      count = add_candidate(cands, count, wrap_idx(image_idx + mode_deltas[mode]), w);
+      break;
+     case NAV_JUMP:  /* Clamped like jump2image(). */
+      if (!mode_deltas[mode]) break;
+      target = image_idx + mode_deltas[mode];
+      target = target < 0 ? 0 : target >= images ? images - 1 : target;
+      count = add_candidate(cands, count, target, w);
+      break;
+     case NAV_DIR:
+      count = add_candidate(cands, count, name_index_next_dir(image_idx, mode_deltas[mode]), w);
+      break;
+     case NAV_RANDOM:
+      if (!random_order) break;
+      dir = set_image_direction(0);
+      count = add_candidate(cands, count, peek_random(images, dir), w);
+      count = add_candidate(cands, count, peek_random(images, 2 * dir), w / 2);
+      break;
+    }
+  }
+  return count;
+}
+
+static int compare_candidates(const void *a, const void *b) {
+  double wa = ((const qiv_prefetch_candidate*)a)->weight;
+  double wb = ((const qiv_prefetch_candidate*)b)->weight;
+  return wa > wb ? -1 : wa < wb;
+}
+
+/* Counts whether the image just loaded was prefetched, then starts
+ * prefetching the images most likely to be shown next. To be called after
+ * an image is loaded.
+ */
+void prefetch_plan(void)
+{
+  qiv_prefetch_candidate cands[PREFETCH_MAX_CANDIDATES];
+  const char *names[PREFETCH_MAX_CANDIDATES];
+  double total = 0;
+  int count, i, name_count = 0, started;
+
+  if (decoders < 2 || images < 2) return;
+  if (nav_mode >= 0) {
+    ++nav_loads[nav_mode];
+    for (i = 0; i < planned_count; ++i) {
+      if (0 == strcmp(planned[i], image_names[image_idx])) {
+        ++nav_hits[nav_mode];
+        break;
+      }
+    }
+    nav_mode = -1;
+  }
+
+  count = propose(cands);
+  qsort(cands, count, sizeof *cands, compare_candidates);
+  for (i = 0; i < count; ++i) total += cands[i].weight;
+  for (i = 0; i < count && name_count < decoders - 1; ++i) {
+    if (cands[i].weight < PREFETCH_MIN_SHARE * total) break;
+    /* With --lazy_filter, the files are checked here, before decoding. */
+    if (!filter_accept_lazily(image_names[cands[i].idx]) ||
+        !filter_is_loadable(image_names[cands[i].idx])) continue;
+    names[name_count++] = image_names[cands[i].idx];
+  }
+  started = decoder_prefetch(names, name_count);
+  for (i = 0; i < planned_count; ++i) free(planned[i]);
+  for (i = 0; i < started; ++i) planned[i] = strdup(names[i]);
+  planned_count = started;
+}
+
+void prefetch_print_stats(void)
+{
+  unsigned long loads = 0, hits = 0;
+  int mode;
+  for (mode = 0; mode < NAV_COUNT; ++mode) {
+    if (!nav_loads[mode]) continue;
+    g_print("prefetch: %s: %lu of %lu images prefetched (%.0f%%)\n",
+            mode_names[mode], nav_hits[mode], nav_loads[mode],
+            100.0 * nav_hits[mode] / nav_loads[mode]);
+    loads += nav_loads[mode];
+    hits += nav_hits[mode];
+  }
+  if (loads)
+    g_print("prefetch: all: %lu of %lu images prefetched (%.0f%%)\n",
+            hits, loads, 100.0 * hits / loads);
+}
@@ -8,6 +8,7 @@
 #include <Imlib2.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #ifdef GTD_XINERAMA
 # include <X11/Xlib.h>
 # include <X11/extensions/Xinerama.h>
@@ -60,6 +61,8 @@ typedef struct _qiv_image {
   gint orig_w, orig_h; /* Size of original image in pixels */
   gint real_w, real_h; /* Size of real (non-thumbnail image in pixels, or (-1, -1) */
   gboolean has_thumbnail;
+  gboolean is_cacheable; /* pixels are unchanged since load, see cache.c */
+  gboolean has_render; /* shrunk image from the render cache, see rendercache.c */
   GdkGC *bg_gc;     /* image window background */
   GdkGC *text_gc;   /* statusbar text color */
   GdkGC *status_gc; /* statusbar background */
@@ -96,6 +99,17 @@ typedef struct _qiv_deletedfile {
   int pos;
 } qiv_deletedfile;
 
+/* Kinds of files in the metadata index */
+#define META_TYPE_UNKNOWN 0
+#define META_TYPE_IMAGE 1
+#define META_TYPE_NOT_IMAGE 2
+
+typedef struct _qiv_meta {
+  gint w, h;        /* of the image file (before autorotate), -1 if unknown */
+  int type;         /* META_TYPE_... */
+  int orientation;  /* EXIF orientation, 0 if none, -1 if unknown */
+} qiv_meta;
+
 extern int              first;
 extern GMainLoop        *qiv_main_loop;
 extern gint             screen_x, screen_y;
@@ -139,6 +153,7 @@ extern int     to_root_s;
 extern int     transparency;
 #define QIV_FLAG_DO_ASSUME_FILES 300
 extern gboolean do_assume_files;
+extern gboolean null_separated;
 #define QIV_FLAG_DO_ENTER_COMMAND 302
 extern gboolean do_enter_command;
 #define QIV_FLAG_DO_F_COMMANDS 303
@@ -150,8 +165,38 @@ extern gboolean do_omit_load_stat;
 extern gboolean do_tag_error_pos;
 #define QIV_FLAG_DO_COPY_LINK 305
 extern gboolean do_copy_link;
+#define QIV_FLAG_DECODERS 306
+extern int     decoders;
+#define QIV_FLAG_DECODER_MEM_LIMIT 307
+extern int     decoder_mem_limit;
+#define QIV_FLAG_CACHE_MB 308
+extern int     cache_mb;
+#define QIV_FLAG_STATS 309
+extern gboolean do_print_stats;
+#define QIV_FLAG_SHM_CACHE 310
+extern int     shm_cache_mb;
+#define QIV_FLAG_NO_RENDER_CACHE 311
+extern gboolean no_render_cache;
+#define QIV_FLAG_RENDER_CACHE_MB 312
+extern int     render_cache_mb;
+#define QIV_FLAG_DO_WRITE_XDG_THUMBNAILS 313
+extern gboolean do_write_xdg_thumbnails;
+#define QIV_FLAG_MAKE_THUMBNAILS 314
+extern gboolean make_thumbnails;
+#define QIV_FLAG_THUMBNAIL_SIZE 315
+extern int     thumbnail_size;
+#define QIV_FLAG_WATCH_DIRS 316
+extern gboolean watch_dirs;
+#define QIV_FLAG_FOLLOW 317
+extern gboolean follow;
+#define QIV_FLAG_LAZY_FILTER 318
+extern gboolean lazy_filter;
+#define QIV_FLAG_MAKE_INDEX 319
+extern gboolean make_index;
+#define QIV_FLAG_NO_META_INDEX 320
+extern gboolean no_meta_index;
+extern gboolean is_image_names_sorted;
 extern gboolean disable_grab;
-extern int     max_rand_num;
 extern int     fixed_window_size;
 extern int     fixed_zoom_factor;
 extern int     zoom_factor;
@@ -175,6 +220,8 @@ extern void get_preferred_xinerama_screens(void);
 
 extern void qiv_exit(int);
 extern void qiv_load_image();
+extern void qiv_timer_update(void);
+extern void main_loop_print_stats(void);
 extern gint add_to_delay(gint delay_delta);
 
 /* image.c */
@@ -189,8 +236,11 @@ extern void qiv_load_image(qiv_image *);
 extern void set_desktop_image(qiv_image *);
 extern void zoom_in(qiv_image *);
 extern void zoom_out(qiv_image *);
+extern void load_full_resolution(qiv_image *);
 extern void zoom_maxpect(qiv_image *);
 extern void reload_image(qiv_image *q);
+extern char *get_th_jpg_filename(const char *);
+extern int save_jpeg_with_realdimen(const char *, gint, gint, int);
 extern void reset_coords(qiv_image *);
 extern void check_size(qiv_image *, gint);
 extern void render_to_pixmap(qiv_image *, double *);
@@ -207,6 +257,136 @@ extern void show_cursor(qiv_image *q);
 extern void setup_magnify(qiv_image *, qiv_mgl *); // [lc]
 extern void update_magnify(qiv_image *, qiv_mgl *,int, gint, gint); // [lc]
 extern void destroy_win(qiv_image *q);
+extern void get_image_meta(const char *, qiv_meta *);
+
+/* cache.c */
+
+extern void cache_put(const char *, const struct stat *);
+extern Imlib_Image cache_get(const char *, const struct stat *);
+extern void cache_print_stats(void);
+
+/* shmcache.c */
+
+extern void shm_cache_start(void);
+extern Imlib_Image shm_cache_get(const struct stat *);
+extern void shm_cache_put(const struct stat *, Imlib_Image);
+extern void shm_cache_print_stats(void);
+
+/* rendercache.c */
+
+extern char *render_cache_filename(const char *, const struct stat *, gint, gint);
+extern Imlib_Image render_cache_get(const char *);
+extern void render_cache_put(const char *, gint, gint, gint, gint);
+extern void render_cache_print_stats(void);
+
+/* xdgthumb.c */
+
+extern char *xdg_thumbnail_filename(const char *, const struct stat *);
+extern void xdg_thumbnail_schedule(qiv_image *, const char *, const struct stat *);
+extern void xdg_thumbnail_print_stats(void);
+
+/* makethumb.c */
+
+extern int make_thumbnail_files(void);
+
+/* dircache.c */
+
+extern gboolean dircache_has_thumbnail(const char *);
+extern ssize_t dircache_readlink(const char *, char *, size_t);
+extern void dircache_print_stats(void);
+
+/* scan.c */
+
+extern int rreaddir(const char *, int);
+extern int rreaddir_each(const char *, int, void (*)(char *));
+extern void append_image_name(char *);
+extern void scan_merge_names(char **, size_t);
+extern void scan_background_add(const char *, int);
+extern void scan_background_start(void);
+extern void scan_background_wait_first(void);
+extern void scan_background_attach(qiv_image *);
+extern void scan_print_stats(void);
+
+/* filelist.c */
+
+extern int rreadfile(const char *, gboolean);
+extern void file_list_attach(qiv_image *);
+extern void file_list_print_stats(void);
+
+/* filter.c */
+
+extern void filter_images(int *, char **);
+extern int is_image_name_accepted(const char *);
+extern int filter_accept_lazily(const char *);
+extern int filter_is_loadable(const char *);
+extern void filter_print_stats(void);
+
+/* metaindex.c */
+
+extern void meta_init(qiv_meta *);
+extern int meta_index_get(const struct stat *, qiv_meta *);
+extern void meta_index_put(const struct stat *, const qiv_meta *);
+extern void meta_index_save(void);
+extern int meta_index_build(void);
+extern void meta_index_print_stats(void);
+
+/* nameindex.c */
+
+extern void name_index_invalidate(void);
+extern int name_index_next_dir(int, int);
+extern int name_index_find(const char *);
+extern void name_index_add(int);
+extern void name_index_remove(int);
+extern void name_index_rename(int, const char *);
+extern void name_index_print_stats(void);
+
+/* prefetch.c */
+
+/* Navigation modes for prefetch_note_nav */
+#define NAV_NEXT 0
+#define NAV_PAGE 1
+#define NAV_JUMP 2
+#define NAV_DIR 3
+#define NAV_RANDOM 4
+#define NAV_SLIDESHOW 5
+#define NAV_COUNT 6
+
+extern void prefetch_note_nav(int, int);
+extern void prefetch_plan(void);
+extern void prefetch_print_stats(void);
+
+/* randperm.c */
+
+extern int get_random(int, int, int);
+extern int peek_random(int, long);
+extern void shuffle_names(char **, int);
+
+/* sniff.c */
+
+extern gboolean sniff_image_header(const unsigned char *, size_t);
+extern int sniff_image_file(const char *);
+
+/* statcache.c */
+
+extern void stat_cache_fill(char **, int);
+extern int stat_cache_lookup(const char *, struct stat *);
+extern int stat_cache_stat(const char *, struct stat *, gboolean);
+extern void stat_cache_forget(const char *);
+extern void stat_cache_print_stats(void);
+
+/* watch.c */
+
+extern void watch_file_update(qiv_image *);
+extern void watch_file_stop(void);
+extern void watch_dir_add(const char *, int);
+extern void watch_dirs_start(qiv_image *);
+extern void watch_print_stats(void);
+
+/* decoder.c */
+
+extern void decoder_pool_start(void);
+extern Imlib_Image decoder_load_image(const char *);
+extern int decoder_prefetch(const char *const *, int);
 
 /* event.c */
 
@@ -215,13 +395,22 @@ extern void qiv_handle_event(GdkEvent *, gpointer);
 /* options.c */
 
 extern int thumbnail;
+extern int numeric_sort, merged_case_sort, ignore_path_sort;
 extern void options_read(int, char **, qiv_image *);
 
+/* sort.c */
+
+extern int my_strcmp(const void *, const void *);
+extern void sort_names(char **, size_t);
+extern int find_sorted_name(char **, int, const char *, int *);
+
 /* utils.c */
 
 extern int  move2trash(void);
 extern int  copy2select(void);
 extern int  undelete_image(void);
+extern void shift_deleted_files(int, int);
+extern void remap_deleted_files(const int *, int);
 extern void jump2image(char *);
 extern void run_command(qiv_image *, const char *, int, char *, int *, const char ***);
 extern void finish(int);
@@ -231,13 +420,9 @@ void next_image_dir(int direction);
 extern int checked_atoi(const char *);
 extern void usage(char *, int);
 extern void show_help(char *, int);
-extern int get_random(int, int, int);
 extern gboolean color_alloc(const char *, GdkColor *);
 extern void swap(int *, int *);
 #define myround qiv_round
 extern int myround(double);
-extern gboolean qiv_watch_file (gpointer);
-extern int rreaddir(const char *, int);
-extern int rreadfile(const char *);
-extern int find_image(int images, char **image_names, char *name);
+extern char *get_xdg_cache_dir(const char *);
 extern void qiv_render_title(qiv_image *q, gboolean is_title);
@@ -0,0 +1,137 @@
+/*
+  Module       : randperm.c
+  Purpose      : Random order of images (qiv -r, -S) as a keyed permutation
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* The random order is a pseudo-random permutation of 0..num-1, computed
+ * for one position at a time: a 4-round Feistel network on indexes of
+ * 2 * half_bits bits (the smallest even width covering num), repeated on
+ * its own output while that is num or more (cycle-walking), which makes it
+ * a permutation of 0..num-1. So no memory per image is needed, and the
+ * image at any position (e.g. the next few ones, to prefetch them) can be
+ * computed without going through the ones before it.
+ *
+ * Each cycle through all images uses a different key, derived from the
+ * seed and the cycle number, so stepping backward (across cycles, too)
+ * shows the same images in reverse.
+ */
+
+#define RAND_PERM_ROUNDS 4
+
+static guint64 seed;
+static gboolean is_seeded;
+static guint64 cycle;  /* Number of the current cycle, its key is derived from it. */
+static int perm_num;  /* Number of images of the current cycle. */
+static int pos;  /* Of the current image in the cycle. */
+
+static guint64 mix64(guint64 x) {  /* The splitmix64 finalizer. */
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static guint64 get_seed(void) {
+  if (!is_seeded) {  /* srand() has been called by main(). */
+    seed = ((guint64)rand() << 42) ^ ((guint64)rand() << 21) ^ (guint64)rand();
+    is_seeded = TRUE;
+  }
+  return seed;
+}
+
+/* Returns the element at position x of the permutation of 0..num-1
+ * selected by key.
+ */
+static int permute(int num, guint64 key, int x) {
+  unsigned half_bits = 1, r;
+  guint64 mask, left, right, tmp, y = x;
+  while (((guint64)1 << (2 * half_bits)) < (guint64)num) ++half_bits;
+  mask = ((guint64)1 << half_bits) - 1;
+  do {
+    left = y >> half_bits;
+    right = y & mask;
+    for (r = 0; r < RAND_PERM_ROUNDS; ++r) {
+      tmp = left ^ (mix64(key ^ ((guint64)r << 56) ^ right) & mask);
+      left = right;
+      right = tmp;
+    }
+    y = left << half_bits | right;
+  } while (y >= (guint64)num);
+  return (int)y;
+}
+
+static guint64 get_cycle_key(guint64 c) {
+  return mix64(get_seed() + c * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Moves *c and *p by steps positions, across cycles of num images. */
+static void move_pos(int num, long steps, guint64 *c, int *p) {
+  long new_pos = *p + steps % num;
+  *c += steps / num;
+  if (new_pos >= num) {
+    new_pos -= num;
+    ++*c;
+  } else if (new_pos < 0) {
+    new_pos += num;
+    --*c;
+  }
+  *p = (int)new_pos;
+}
+
+/* returns a random number from the integers 0..num-1: the next one (or
+   the previous one if direction is negative) in a random order of them.
+   With replacement (replace=1) or without replacement (replace=0), both
+   are the same. */
+int get_random(int replace, int num, int direction)
+{
+  (void)replace;
+  if (num <= 1) return 0;
+  if (perm_num != num) {  /* Images added or removed, start a new cycle. */
+    perm_num = num;
+    pos = num - 1;  /* The next one is the first of the next cycle. */
+    ++cycle;
+  }
+  move_pos(num, direction < 0 ? -1 : 1, &cycle, &pos);
+  return permute(num, get_cycle_key(cycle), pos);
+}
+
+/* Returns what get_random() would return after steps (negative to go
+ * backward) calls with the same num.
+ */
+int peek_random(int num, long steps)
+{
+  guint64 c = cycle;
+  int p = pos;
+  if (num <= 1) return 0;
+  if (perm_num != num) {
+    p = num - 1;
+    ++c;
+  }
+  move_pos(num, steps, &c, &p);
+  return permute(num, get_cycle_key(c), p);
+}
+
+/* Shuffles names (qiv -S). */
+void shuffle_names(char **names, int count)
+{
+  char **shuffled;
+  guint64 key = mix64(get_seed() ^ 0x5348554646ULL);
+  int i;
+  if (count < 2) return;
+  shuffled = (char**)xmalloc(count * sizeof *shuffled);
+  for (i = 0; i < count; ++i) {
+    shuffled[i] = names[permute(count, key, i)];
+  }
+  memcpy(names, shuffled, count * sizeof *shuffled);
+  free(shuffled);
+}
@@ -0,0 +1,186 @@
+/*
+  Module       : rendercache.c
+  Purpose      : On-disk cache of screen-sized renders of large images
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* Images larger than the screen are displayed shrunk in maxpect and
+ * scale_down mode, but decoding them takes the same time every day. So
+ * qiv saves the shrunk image as a JPEG file to $XDG_CACHE_HOME/qiv (usually
+ * ~/.cache/qiv), and next time it loads that instead. The file name is a
+ * hash of (absolute path, mtime, size, screen size, autorotate), and the
+ * JPEG has a REALDIMEN: comment with the size of the original image, the
+ * same as *.th.jpg thumbnails. Cache files are touched when used, and the
+ * least recently used ones are deleted when the cache is larger than
+ * render_cache_mb MiB.
+ */
+
+static char *render_cache_dir;
+static gboolean is_render_cache_dir_ok;
+static unsigned long render_hits, render_misses, render_puts, render_removes;
+static unsigned puts_since_cleanup;
+
+/* Returns FALSE if the cache directory is unusable. */
+static gboolean setup_render_cache_dir(void) {
+  if (!render_cache_dir) {
+    render_cache_dir = get_xdg_cache_dir("qiv");
+    is_render_cache_dir_ok = render_cache_dir != NULL;
+    if (!render_cache_dir) render_cache_dir = g_strdup("");
+  }
+  return is_render_cache_dir_ok;
+}
+
+static unsigned long long fnv1a(unsigned long long h, const void *p, size_t size) {
+  const unsigned char *c = (const unsigned char*)p;
+  for (; size > 0; --size, ++c) {
+    h = (h ^ *c) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* Returns the name of the cache file (to be freed by the caller) for the
+ * image image_name with stat st when shrunk to fit screen_w x screen_h, or
+ * NULL if the render cache is disabled.
+ */
+char *render_cache_filename(const char *image_name, const struct stat *st,
+                            gint screen_w, gint screen_h)
+{
+  char *abs_name;
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  long long key[5];
+
+  if (no_render_cache || render_cache_mb <= 0 || !setup_render_cache_dir())
+    return NULL;
+  abs_name = realpath(image_name, NULL);
+  if (!abs_name) return NULL;
+  h = fnv1a(h, abs_name, strlen(abs_name) + 1);
+  free(abs_name);
+  key[0] = st->st_mtime;
+  key[1] = st->st_size;
+  key[2] = screen_w;
+  key[3] = screen_h;
+  /* The EXIF orientation is part of the file, only autorotate matters. */
+  key[4] = autorotate;
+  h = fnv1a(h, key, sizeof key);
+  return g_strdup_printf("%s/%016llx.jpg", render_cache_dir, h);
+}
+
+/* Loads the cached render from filename, or returns NULL. */
+Imlib_Image render_cache_get(const char *filename)
+{
+  Imlib_Image im = imlib_load_image_without_cache(filename);
+  if (im) {
+    utimes(filename, NULL);  /* For LRU cleanup. */
+    ++render_hits;
+  } else {
+    ++render_misses;
+  }
+  return im;
+}
+
+typedef struct {
+  char *name;
+  off_t size;
+  time_t mtime;
+} render_cache_file;
+
+static int compare_mtime(const void *a, const void *b) {
+  const render_cache_file *fa = (const render_cache_file*)a;
+  const render_cache_file *fb = (const render_cache_file*)b;
+  return fa->mtime < fb->mtime ? -1 : fa->mtime > fb->mtime;
+}
+
+/* Deletes the least recently used files until the cache fits in 90% of
+ * render_cache_mb.
+ */
+static void render_cache_cleanup(void) {
+  const off_t budget = (off_t)render_cache_mb << 20;
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  render_cache_file *files = NULL;
+  size_t file_count = 0, file_cap = 0, i;
+  off_t total = 0;
+  char *name;
+
+  if ((d = opendir(render_cache_dir)) == NULL) return;
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len < 4 || 0 != strcmp(de->d_name + len - 4, ".jpg")) continue;
+    name = g_strdup_printf("%s/%s", render_cache_dir, de->d_name);
+    if (stat(name, &st) != 0 || !S_ISREG(st.st_mode)) {
+      g_free(name);
+      continue;
+    }
+    if (file_count == file_cap) {
+      file_cap = file_cap ? file_cap * 2 : 64;
+      files = xrealloc(files, file_cap * sizeof *files);
+    }
+    files[file_count].name = name;
+    files[file_count].size = st.st_size;
+    files[file_count].mtime = st.st_mtime;
+    ++file_count;
+    total += st.st_size;
+  }
+  closedir(d);
+  if (total > budget) {
+    qsort(files, file_count, sizeof *files, compare_mtime);
+    for (i = 0; i < file_count && total > budget / 10 * 9; ++i) {
+      if (unlink(files[i].name) == 0) {
+        total -= files[i].size;
+        ++render_removes;
+      }
+    }
+  }
+  for (i = 0; i < file_count; ++i) g_free(files[i].name);
+  free(files);
+}
+
+/* Saves the image in the Imlib2 context, shrunk to w x h, to filename.
+ * real_w and real_h are the dimensions of the original image.
+ */
+void render_cache_put(const char *filename, gint w, gint h,
+                      gint real_w, gint real_h)
+{
+  Imlib_Image orig_im = imlib_context_get_image();
+  Imlib_Image im;
+  char old_anti_alias;
+  int result;
+
+  if (!orig_im || imlib_image_has_alpha() || w <= 0 || h <= 0) return;
+  old_anti_alias = imlib_context_get_anti_alias();
+  imlib_context_set_anti_alias(1);
+  im = imlib_create_cropped_scaled_image(
+      0, 0, imlib_image_get_width(), imlib_image_get_height(), w, h);
+  imlib_context_set_anti_alias(old_anti_alias);
+  if (!im) return;
+  imlib_context_set_image(im);
+  result = save_jpeg_with_realdimen(filename, real_w, real_h, 90);
+  imlib_free_image();
+  imlib_context_set_image(orig_im);
+  if (result == 0) {
+    ++render_puts;
+    if (puts_since_cleanup++ % 32 == 0) render_cache_cleanup();
+  }
+}
+
+void render_cache_print_stats(void)
+{
+  if (!is_render_cache_dir_ok) return;
+  g_print("render_cache: %lu hits, %lu misses, %lu puts, %lu files removed (%s)\n",
+          render_hits, render_misses, render_puts, render_removes,
+          render_cache_dir);
+}
@@ -0,0 +1,604 @@
+/*
+  Module       : scan.c
+  Purpose      : Read the image file names from directory trees
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* rreaddir() trusts d_type, and calls fstatat() relative to the directory
+ * fd only for symlinks and filesystems which don't fill d_type. With -u,
+ * subdirectories are read by a pool of threads (most of the time is spent
+ * waiting for the disk or NFS server, so there are more threads than
+ * CPUs), each taking work from its own deque and stealing from the others
+ * when it runs out. The entries are kept in a tree in readdir() order, and
+ * flattened depth-first at the end, so image_names gets the same order as
+ * with a single-threaded recursive read.
+ *
+ * If the image_names will be sorted anyway, the directories on the command
+ * line are read in the background instead (scan_background_add()), so the
+ * first image can be displayed right away. The workers filter the files
+ * they find, and pass them to the main thread in batches, which merges
+ * them to the sorted image_names, keeping the current image. To keep the
+ * merging O(n log n) in total, found files are only merged when there are
+ * many compared to images, or when the scan has finished.
+ */
+
+#define SCAN_MAX_THREADS 32
+/* Subdirectories waiting in the deques are kept open (to openat() them
+ * relative to their parent) up to this many, then reopened by path.
+ */
+#define SCAN_MAX_OPEN_FDS 256
+/* A worker passes this many found files at once to the main thread. */
+#define SCAN_BATCH_SIZE 256
+
+typedef struct qiv_scan_dir qiv_scan_dir;
+
+typedef struct {
+  char *name;  /* Basename. */
+  qiv_scan_dir *subdir;  /* Non-NULL for a directory. */
+} qiv_scan_entry;
+
+struct qiv_scan_dir {
+  char *path;
+  int fd;  /* Opened relative to the parent, or -1. */
+  qiv_scan_entry *entries;  /* In readdir() order. */
+  size_t count, cap;
+};
+
+typedef struct {
+  pthread_mutex_t lock;
+  qiv_scan_dir **items;  /* Owner pops from the tail, thieves from the head. */
+  size_t head, tail, cap;
+} qiv_scan_deque;
+
+typedef struct {
+  char **names;
+  size_t count, cap;
+} qiv_name_list;
+
+typedef struct {
+  qiv_scan_deque *deques;
+  int thread_count;
+  int recursive;
+  /* In the background, found files go to batches[worker] and then to
+   * found_names instead of the tree.
+   */
+  gboolean is_background;
+  qiv_name_list *batches;
+  pthread_mutex_t lock;  /* Protects the fields below. */
+  pthread_cond_t cond;
+  unsigned long pending;  /* Directories pushed but not read yet. */
+  unsigned long push_seq;
+  int open_fds;
+} qiv_scan_pool;
+
+typedef struct {
+  qiv_scan_pool *pool;
+  int idx;
+} qiv_scan_worker;
+
+static unsigned long scan_dirs, scan_files, scan_fstatats;
+static double scan_secs;
+static int scan_max_threads;
+
+/* Background scan. */
+static char **bg_dirs;
+static int bg_dir_count, bg_recursive;
+static pthread_t bg_thread;
+static int bg_pipe[2] = {-1, -1};  /* Workers wake up the main thread. */
+static pthread_mutex_t found_lock = PTHREAD_MUTEX_INITIALIZER;
+static qiv_name_list found_names;  /* Protected by found_lock. */
+static gboolean is_bg_done;  /* Protected by found_lock. */
+static gboolean is_bg_running;
+static gboolean is_first_flushed;  /* Accessed atomically. */
+static qiv_name_list pending_names;  /* Taken from found_names, not merged yet. */
+static qiv_image *bg_q;
+static unsigned long bg_merges;
+static struct timeval bg_start;
+static double bg_first_secs = -1, bg_total_secs;
+
+static void name_list_add(qiv_name_list *list, char *name) {
+  if (list->count == list->cap) {
+    list->cap = list->cap ? list->cap * 2 : SCAN_BATCH_SIZE;
+    list->names = xrealloc(list->names, list->cap * sizeof *list->names);
+  }
+  list->names[list->count++] = name;
+}
+
+static double secs_since(const struct timeval *tv) {
+  struct timeval now;
+  gettimeofday(&now, 0);
+  return (now.tv_sec - tv->tv_sec) + (now.tv_usec - tv->tv_usec) / 1.0e6;
+}
+
+/* Passes the batch of a worker to the main thread. */
+static void flush_batch(qiv_name_list *batch) {
+  size_t i;
+  gboolean is_wakeup_needed;
+  char c = 0;
+  if (!batch->count) return;
+  pthread_mutex_lock(&found_lock);
+  is_wakeup_needed = found_names.count == 0;
+  for (i = 0; i < batch->count; ++i) name_list_add(&found_names, batch->names[i]);
+  pthread_mutex_unlock(&found_lock);
+  batch->count = 0;
+  __atomic_store_n(&is_first_flushed, TRUE, __ATOMIC_RELAXED);
+  if (is_wakeup_needed && write(bg_pipe[1], &c, 1) < 0) {}
+}
+
+static void deque_push(qiv_scan_deque *dq, qiv_scan_dir *dir) {
+  pthread_mutex_lock(&dq->lock);
+  if (dq->tail == dq->cap) {
+    if (dq->head > 0) {  /* Reuse the space of the stolen ones. */
+      memmove(dq->items, dq->items + dq->head, (dq->tail - dq->head) * sizeof *dq->items);
+      dq->tail -= dq->head;
+      dq->head = 0;
+    }
+    if (dq->tail == dq->cap) {
+      dq->cap = dq->cap ? dq->cap * 2 : 64;
+      dq->items = xrealloc(dq->items, dq->cap * sizeof *dq->items);
+    }
+  }
+  dq->items[dq->tail++] = dir;
+  pthread_mutex_unlock(&dq->lock);
+}
+
+static qiv_scan_dir *deque_pop(qiv_scan_deque *dq, gboolean is_steal) {
+  qiv_scan_dir *dir = NULL;
+  pthread_mutex_lock(&dq->lock);
+  if (dq->head < dq->tail) dir = is_steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+  if (dq->head == dq->tail) dq->head = dq->tail = 0;
+  pthread_mutex_unlock(&dq->lock);
+  return dir;
+}
+
+static void add_entry(qiv_scan_dir *dir, const char *name, qiv_scan_dir *subdir) {
+  if (dir->count == dir->cap) {
+    dir->cap = dir->cap ? dir->cap * 2 : 16;
+    dir->entries = xrealloc(dir->entries, dir->cap * sizeof *dir->entries);
+  }
+  dir->entries[dir->count].name = strdup(name);
+  dir->entries[dir->count].subdir = subdir;
+  ++dir->count;
+}
+
+static qiv_scan_dir *new_scan_dir(const char *path, int fd) {
+  qiv_scan_dir *dir = (qiv_scan_dir*)xcalloc(1, sizeof *dir);
+  dir->path = strdup(path);
+  dir->fd = fd;
+  return dir;
+}
+
+/* Reads dir, pushing its subdirectories to the deque of worker idx. */
+static void scan_one_dir(qiv_scan_pool *pool, int idx, qiv_scan_dir *dir) {
+  int fd = dir->fd, subfd;
+  DIR *d;
+  struct dirent *de;
+  struct stat st;
+  gboolean is_dir;
+  char subpath[FILENAME_LEN];
+  qiv_scan_dir *subdir;
+
+  dir->fd = -1;  /* Closed by closedir() below. */
+  if (fd < 0) {
+    fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else {
+    pthread_mutex_lock(&pool->lock);
+    --pool->open_fds;
+    pthread_mutex_unlock(&pool->lock);
+  }
+  if (fd < 0) return;
+  if ((d = fdopendir(fd)) == NULL) {
+    close(fd);
+    return;
+  }
+  if (watch_dirs)  /* Before reading, so no new file is missed. */
+    watch_dir_add(dir->path, pool->recursive);
+  while ((de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name,".") == 0 ||
+        strcmp(de->d_name,"..") == 0 ||
+        strcmp(de->d_name,TRASH_DIR) == 0)
+      continue;
+    if (de->d_type == DT_DIR) {
+      is_dir = TRUE;
+    } else if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+      __atomic_add_fetch(&scan_fstatats, 1, __ATOMIC_RELAXED);
+      is_dir = fstatat(fd, de->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+    } else {
+      is_dir = FALSE;
+    }
+    if (!is_dir) {
+      if (pool->is_background) {
+        char *name = xpool_path(dir->path, de->d_name);
+        __atomic_add_fetch(&scan_files, 1, __ATOMIC_RELAXED);
+        if (is_image_name_accepted(name)) {
+          name_list_add(&pool->batches[idx], name);
+          /* The first one is shown right away. */
+          if (pool->batches[idx].count >= SCAN_BATCH_SIZE ||
+              !__atomic_load_n(&is_first_flushed, __ATOMIC_RELAXED))
+            flush_batch(&pool->batches[idx]);
+        } else {
+          xpool_free_last(name);
+        }
+      } else {
+        add_entry(dir, de->d_name, NULL);
+      }
+      continue;
+    }
+    if (!pool->recursive) continue;
+    /* Too long: stops symlink loops, as a truncated path did before. */
+    if ((size_t)snprintf(subpath, sizeof subpath, "%s/%s", dir->path, de->d_name) >=
+        sizeof subpath) continue;
+    subfd = -1;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->open_fds < SCAN_MAX_OPEN_FDS &&
+        (subfd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+      ++pool->open_fds;
+    pthread_mutex_unlock(&pool->lock);
+    subdir = new_scan_dir(subpath, subfd);
+    if (!pool->is_background) add_entry(dir, de->d_name, subdir);
+    deque_push(&pool->deques[idx], subdir);
+    pthread_mutex_lock(&pool->lock);
+    ++pool->pending;
+    ++pool->push_seq;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+  closedir(d);
+}
+
+static qiv_scan_dir *take_work(qiv_scan_pool *pool, int idx) {
+  qiv_scan_dir *dir = deque_pop(&pool->deques[idx], FALSE);
+  int i;
+  for (i = 1; !dir && i < pool->thread_count; ++i) {
+    dir = deque_pop(&pool->deques[(idx + i) % pool->thread_count], TRUE);
+  }
+  return dir;
+}
+
+static void *scan_worker(void *arg) {
+  qiv_scan_worker *w = arg;
+  qiv_scan_pool *pool = w->pool;
+  qiv_scan_dir *dir;
+  unsigned long seen_seq;
+  gboolean is_done;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    seen_seq = pool->push_seq;
+    pthread_mutex_unlock(&pool->lock);
+    if ((dir = take_work(pool, w->idx)) != NULL) {
+      scan_one_dir(pool, w->idx, dir);
+      if (pool->is_background) {  /* Not in a tree, free it now. */
+        __atomic_add_fetch(&scan_dirs, 1, __ATOMIC_RELAXED);
+        free(dir->path);
+        free(dir);
+      }
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0) pthread_cond_broadcast(&pool->cond);
+      pthread_mutex_unlock(&pool->lock);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending && pool->push_seq == seen_seq)
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    is_done = pool->pending == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (is_done) break;
+  }
+  if (pool->is_background) flush_batch(&pool->batches[w->idx]);
+  return NULL;
+}
+
+void append_image_name(char *name)
+{
+  if (images >= max_image_cnt) {
+    max_image_cnt += 8192;
+    if (!image_names)
+      image_names = (char**)xmalloc(max_image_cnt * sizeof(char*));
+    else
+      image_names = (char**)xrealloc(image_names,max_image_cnt*sizeof(char*));
+  }
+  image_names[images++] = name;
+  name_index_add(images - 1);
+}
+
+/* Passes the files of dir to add depth-first, and frees dir. Returns the
+ * number of files.
+ */
+static int flatten_scan_dir(qiv_scan_dir *dir, void (*add)(char *)) {
+  size_t i;
+  int count = 0;
+  ++scan_dirs;
+  for (i = 0; i < dir->count; ++i) {
+    qiv_scan_entry *e = &dir->entries[i];
+    if (e->subdir) {
+      count += flatten_scan_dir(e->subdir, add);
+    } else {
+      add(xpool_path(dir->path, e->name));
+      ++scan_files;
+      ++count;
+    }
+    free(e->name);
+  }
+  free(dir->entries);
+  free(dir->path);
+  free(dir);
+  return count;
+}
+
+static int get_scan_thread_count(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long n = cpus > 0 ? cpus * 4 : 4;
+  return n > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : n;
+}
+
+/* Reads root (and its subdirectories if recursive) with a pool of threads. */
+static void run_scan(qiv_scan_dir *root, int recursive, gboolean is_background) {
+  qiv_scan_pool pool;
+  qiv_scan_worker workers[SCAN_MAX_THREADS];
+  pthread_t threads[SCAN_MAX_THREADS];
+  int i, started;
+
+  memset(&pool, 0, sizeof pool);
+  pool.thread_count = recursive ? get_scan_thread_count() : 1;
+  pool.recursive = recursive;
+  pool.is_background = is_background;
+  if (is_background)
+    pool.batches = (qiv_name_list*)xcalloc(pool.thread_count, sizeof *pool.batches);
+  pool.pending = 1;
+  pool.open_fds = 1;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.cond, NULL);
+  pool.deques = (qiv_scan_deque*)xcalloc(pool.thread_count, sizeof *pool.deques);
+  for (i = 0; i < pool.thread_count; ++i) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    workers[i].pool = &pool;
+    workers[i].idx = i;
+  }
+  deque_push(&pool.deques[0], root);
+  /* The calling thread is worker 0. */
+  for (started = 1; started < pool.thread_count; ++started) {
+    if (pthread_create(&threads[started], NULL, scan_worker, &workers[started]) != 0)
+      break;
+  }
+  scan_worker(&workers[0]);
+  for (i = 1; i < started; ++i) pthread_join(threads[i], NULL);
+  for (i = 0; i < pool.thread_count; ++i) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques[i].items);
+  }
+  free(pool.deques);
+  if (is_background) {
+    for (i = 0; i < pool.thread_count; ++i) free(pool.batches[i].names);
+    free(pool.batches);
+  }
+  pthread_cond_destroy(&pool.cond);
+  pthread_mutex_destroy(&pool.lock);
+  if (started > scan_max_threads) scan_max_threads = started;
+}
+
+/* Recursively gets all files from a directory if <recursive> is true,
+ * else just reads directory */
+int rreaddir(const char *dirname, int recursive)
+{
+  return rreaddir_each(dirname, recursive, append_image_name);
+}
+
+/* Like rreaddir(), but passes each file name (owned by the callee) to add
+ * instead of appending it to image_names. Returns the number of names, or
+ * -1 if dirname can't be opened.
+ */
+int rreaddir_each(const char *dirname, int recursive, void (*add)(char *))
+{
+  qiv_scan_dir *root;
+  char cdirname[FILENAME_LEN];
+  struct timeval before;
+  int count, fd;
+
+  strncpy(cdirname, dirname, sizeof cdirname);
+  cdirname[FILENAME_LEN-1] = '\0';
+
+  if ((fd = open(cdirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+    return -1;
+  gettimeofday(&before, 0);
+  root = new_scan_dir(cdirname, fd);
+  run_scan(root, recursive, FALSE);
+  count = flatten_scan_dir(root, add);
+  scan_secs += secs_since(&before);
+  return count;
+}
+
+/* Remembers dirname to be read by scan_background_start(). */
+void scan_background_add(const char *dirname, int recursive)
+{
+  bg_dirs = (char**)xrealloc(bg_dirs, (bg_dir_count + 1) * sizeof *bg_dirs);
+  bg_dirs[bg_dir_count++] = strdup(dirname);
+  bg_recursive = recursive;
+}
+
+static void *scan_background_thread(void *arg) {
+  int i, fd;
+  char c = 0;
+  (void)arg;
+  for (i = 0; i < bg_dir_count; ++i) {
+    if ((fd = open(bg_dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)
+      run_scan(new_scan_dir(bg_dirs[i], fd), bg_recursive, TRUE);
+    free(bg_dirs[i]);
+  }
+  free(bg_dirs);
+  pthread_mutex_lock(&found_lock);
+  is_bg_done = TRUE;
+  pthread_mutex_unlock(&found_lock);
+  if (write(bg_pipe[1], &c, 1) < 0) {}
+  return NULL;
+}
+
+/* Starts reading the directories passed to scan_background_add(). */
+void scan_background_start(void)
+{
+  if (!bg_dir_count) return;
+  gettimeofday(&bg_start, 0);
+  if (pipe(bg_pipe) != 0 ||
+      pthread_create(&bg_thread, NULL, scan_background_thread, NULL) != 0) {
+    int i;  /* Read them now instead. */
+    for (i = 0; i < bg_dir_count; ++i) {
+      rreaddir(bg_dirs[i], bg_recursive);
+      free(bg_dirs[i]);
+    }
+    free(bg_dirs);
+    bg_dir_count = 0;
+    sort_names(image_names, images);
+    return;
+  }
+  fcntl(bg_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(bg_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(bg_pipe[1], F_SETFD, FD_CLOEXEC);
+  is_bg_running = TRUE;
+}
+
+/* Moves found_names to pending_names. Returns TRUE if the scan is done. */
+static gboolean take_found_names(void) {
+  gboolean is_done;
+  char buf[64];
+  size_t i;
+  while (read(bg_pipe[0], buf, sizeof buf) > 0) {}
+  pthread_mutex_lock(&found_lock);
+  for (i = 0; i < found_names.count; ++i) name_list_add(&pending_names, found_names.names[i]);
+  found_names.count = 0;
+  is_done = is_bg_done;
+  pthread_mutex_unlock(&found_lock);
+  if (pending_names.count && bg_first_secs < 0) bg_first_secs = secs_since(&bg_start);
+  return is_done;
+}
+
+/* Merges names[0..n) to the sorted image_names, keeping image_idx
+ * pointing to the same image. Names already in image_names are dropped.
+ */
+void scan_merge_names(char **p, size_t n)
+{
+  char **merged;
+  size_t i = 0, j = 0, k = 0, cap;
+  int new_idx = image_idx, inserted_count = 0;
+  int *inserted_at;  /* Index in the old image_names of each name added. */
+
+  if (!n) return;
+  sort_names(p, n);
+  cap = images + n + 8192;
+  merged = (char**)xmalloc(cap * sizeof *merged);
+  inserted_at = (int*)xmalloc(n * sizeof *inserted_at);
+  while (i < (size_t)images || j < n) {
+    if (j == n || (i < (size_t)images && my_strcmp(&image_names[i], &p[j]) <= 0)) {
+      if (i == (size_t)image_idx) new_idx = k;
+      if (j < n && 0 == strcmp(image_names[i], p[j])) {
+        ++j;  /* Already added, e.g. by --watch_dirs. */
+      }
+      merged[k++] = image_names[i++];
+    } else {
+      inserted_at[inserted_count++] = i;
+      merged[k++] = p[j++];
+    }
+  }
+  remap_deleted_files(inserted_at, inserted_count);
+  free(inserted_at);
+  free(image_names);
+  image_names = merged;
+  max_image_cnt = cap;
+  images = k;
+  name_index_invalidate();
+  image_idx = new_idx;
+}
+
+static void merge_pending_names(void) {
+  if (!pending_names.count) return;
+  ++bg_merges;
+  scan_merge_names(pending_names.names, pending_names.count);
+  pending_names.count = 0;
+}
+
+static void finish_background_scan(void) {
+  pthread_join(bg_thread, NULL);
+  close(bg_pipe[0]);
+  close(bg_pipe[1]);
+  bg_pipe[0] = bg_pipe[1] = -1;
+  is_bg_running = FALSE;
+  bg_total_secs = secs_since(&bg_start);
+  free(pending_names.names);
+  free(found_names.names);
+  pending_names.names = found_names.names = NULL;
+  pending_names.cap = found_names.cap = 0;
+}
+
+/* Waits until the background scan has found an image (unless there is one
+ * already), or it has finished.
+ */
+void scan_background_wait_first(void)
+{
+  struct pollfd pfd;
+  gboolean is_done;
+  if (!is_bg_running) return;
+  for (;;) {
+    is_done = take_found_names();
+    if (images || pending_names.count || is_done) break;
+    pfd.fd = bg_pipe[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, -1);
+  }
+  merge_pending_names();
+  if (is_done) finish_background_scan();
+}
+
+static gboolean handle_scan_wakeup(GIOChannel *source, GIOCondition condition, gpointer data) {
+  gboolean is_done = take_found_names();
+  (void)source; (void)condition; (void)data;
+  if (pending_names.count && (is_done || pending_names.count >= (size_t)images / 2)) {
+    merge_pending_names();
+    update_image(bg_q, MOVED);  /* Update [idx/total] in the title. */
+  }
+  if (is_done) {
+    finish_background_scan();
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Merges the images found in the background as they come in the main
+ * loop.
+ */
+void scan_background_attach(qiv_image *q)
+{
+  GIOChannel *channel;
+  if (!is_bg_running) return;
+  bg_q = q;
+  channel = g_io_channel_unix_new(bg_pipe[0]);
+  g_io_add_watch(channel, G_IO_IN, handle_scan_wakeup, NULL);
+  g_io_channel_unref(channel);
+}
+
+void scan_print_stats(void)
+{
+  if (!scan_dirs) return;
+  g_print("scan: %lu directories, %lu files, %lu fstatat calls in %.2fs (%d threads)\n",
+          scan_dirs, scan_files, scan_fstatats, scan_secs, scan_max_threads);
+  if (bg_first_secs >= 0) {
+    g_print("scan: in the background, first image found after %.3fs, "
+            "all after %.2fs, %lu merges\n", bg_first_secs, bg_total_secs, bg_merges);
+  }
+}
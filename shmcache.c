@@ -0,0 +1,356 @@
+/*
+  Module       : shmcache.c
+  Purpose      : Decoded image cache shared by qiv processes in /dev/shm
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+
+/* With --shm_cache, every qiv process of the user publishes the images it
+ * decodes to /dev/shm/qiv-$UID, and looks there before decoding, so
+ * multiple qiv windows on the same photos decode each file only once.
+ *
+ * The directory contains an index file, mmap()ed by all processes, with a
+ * fixed number of slots, and one file per cached image with the raw ARGB
+ * pixels (named after the slot and its generation). The index is never
+ * locked: slots change state with compare-and-swap, and readers verify the
+ * generation of the slot after reading its fields. Pixel files are
+ * immutable once published, and eviction only unlinks them, so a reader
+ * which has opened (or mmap()ed) one can always finish, the kernel keeps a
+ * reference count on the file. A transient state of a slot includes the
+ * pid of the process holding it, in the same word, so a slot is never seen
+ * in a transient state without its owner. A process crashing while holding
+ * a slot leaves its pid there, other processes reclaim the slot if that pid
+ * doesn't exist anymore. Nothing else has to be cleaned up after a crash.
+ */
+
+#define SHM_CACHE_MAGIC 0x51495643u  /* "QIVC" */
+#define SHM_CACHE_SLOTS 1024
+
+/* Kinds of slot states. The state of a slot is its kind, and for the
+ * transient kinds, the pid of the owner shifted by SLOT_PID_SHIFT.
+ */
+enum {
+  SLOT_FREE = 0,
+  SLOT_WRITING,  /* The owner is writing the pixel file. */
+  SLOT_READY,
+  SLOT_EVICTING  /* The owner is unlinking the pixel file. */
+};
+#define SLOT_KIND_MASK 3u
+#define SLOT_PID_SHIFT 2
+
+typedef struct {
+  uint32_t state;
+  uint32_t reserved;
+  uint64_t generation;  /* Changes whenever the slot is reused. */
+  /* Key. */
+  uint64_t dev, ino, mtime, size;
+  uint32_t scale;  /* Decode scale divisor, 1 for full size. */
+  /* Value. */
+  uint32_t w, h, has_alpha;
+  uint64_t bytes;
+  uint64_t last_used;  /* For LRU eviction, value of use_clock. */
+} shm_cache_slot;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t slot_count;
+  uint64_t next_generation;
+  uint64_t use_clock;  /* Incremented at each use of a slot. */
+  shm_cache_slot slots[SHM_CACHE_SLOTS];
+} shm_cache_index;
+
+static shm_cache_index *shm_index;
+static char shm_dir[64];
+static unsigned long shm_hits, shm_misses, shm_puts, shm_evictions,
+    shm_reclaims;
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define CAS(p, old, new) __extension__ ({ \
+    __typeof__(*(p)) cas_old_ = (old); \
+    __atomic_compare_exchange_n(p, &cas_old_, new, 0, \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+
+static uint64_t tick(void) {
+  return __atomic_add_fetch(&shm_index->use_clock, 1, __ATOMIC_ACQ_REL);
+}
+
+static void slot_filename(char *buf, size_t size, unsigned idx, uint64_t generation) {
+  snprintf(buf, size, "%s/%u-%llu", shm_dir, idx, (unsigned long long)generation);
+}
+
+static uint32_t owned_state(uint32_t kind) {
+  return kind | (uint32_t)getpid() << SLOT_PID_SHIFT;
+}
+
+static uint32_t state_kind(uint32_t state) {
+  return state & SLOT_KIND_MASK;
+}
+
+static gboolean is_pid_dead(uint32_t pid) {
+  return pid != 0 && kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/* Opens (creates) the shared index. Called once at startup. */
+void shm_cache_start(void)
+{
+  char index_name[80];
+  int fd;
+  struct stat st;
+  void *p;
+
+  if (shm_cache_mb <= 0) return;
+  snprintf(shm_dir, sizeof shm_dir, "/dev/shm/qiv-%u", (unsigned)getuid());
+  if (mkdir(shm_dir, 0700) != 0 && errno != EEXIST) goto error;
+  if (lstat(shm_dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+    errno = EPERM;
+    goto error;
+  }
+  /* Not "index": the slots of older versions had the owner separately. */
+  snprintf(index_name, sizeof index_name, "%s/index2", shm_dir);
+  if ((fd = open(index_name, O_RDWR | O_CREAT, 0600)) < 0) goto error;
+  /* Concurrent creators all extend to the same size, the new space is
+   * zeroed, and zero means SLOT_FREE.
+   */
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size < (off_t)sizeof(shm_cache_index) &&
+       ftruncate(fd, sizeof(shm_cache_index)) != 0)) {
+    close(fd);
+    goto error;
+  }
+  p = mmap(NULL, sizeof(shm_cache_index), PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) goto error;
+  shm_index = (shm_cache_index*)p;
+  CAS(&shm_index->magic, 0, SHM_CACHE_MAGIC);
+  CAS(&shm_index->slot_count, 0, SHM_CACHE_SLOTS);
+  if (LOAD(&shm_index->magic) != SHM_CACHE_MAGIC ||
+      LOAD(&shm_index->slot_count) != SHM_CACHE_SLOTS) {
+    fprintf(stderr, "qiv: incompatible shared cache index %s, not using it\n",
+            index_name);
+    munmap(p, sizeof(shm_cache_index));
+    shm_index = NULL;
+  }
+  return;
+ error:
+  fprintf(stderr, "qiv: cannot use shared cache in %s: %s\n",
+          shm_dir, strerror(errno));
+}
+
+/* Moves a slot in a transient state back to SLOT_FREE if its owner has
+ * died.
+ */
+static void reclaim_slot(unsigned idx) {
+  shm_cache_slot *s = &shm_index->slots[idx];
+  uint32_t state = LOAD(&s->state);
+  char name[96];
+  if ((state_kind(state) == SLOT_WRITING || state_kind(state) == SLOT_EVICTING) &&
+      is_pid_dead(state >> SLOT_PID_SHIFT) &&
+      CAS(&s->state, state, owned_state(SLOT_EVICTING))) {
+    slot_filename(name, sizeof name, idx, LOAD(&s->generation));
+    unlink(name);
+    CAS(&s->state, owned_state(SLOT_EVICTING), SLOT_FREE);
+    ++shm_reclaims;
+  }
+}
+
+/* Evicts the least recently used ready slot. Returns FALSE if there was
+ * nothing to evict.
+ */
+static gboolean evict_one(void) {
+  unsigned i, best = SHM_CACHE_SLOTS;
+  uint64_t best_used = 0;
+  char name[96];
+  shm_cache_slot *s;
+  for (i = 0; i < SHM_CACHE_SLOTS; ++i) {
+    s = &shm_index->slots[i];
+    if (LOAD(&s->state) == SLOT_READY &&
+        (best == SHM_CACHE_SLOTS || LOAD(&s->last_used) < best_used)) {
+      best = i;
+      best_used = LOAD(&s->last_used);
+    }
+  }
+  if (best == SHM_CACHE_SLOTS) return FALSE;
+  s = &shm_index->slots[best];
+  if (CAS(&s->state, SLOT_READY, owned_state(SLOT_EVICTING))) {
+    slot_filename(name, sizeof name, best, LOAD(&s->generation));
+    unlink(name);
+    CAS(&s->state, owned_state(SLOT_EVICTING), SLOT_FREE);
+    ++shm_evictions;
+  }
+  return TRUE;  /* Even if someone else was faster. */
+}
+
+static uint64_t used_bytes(void) {
+  unsigned i;
+  uint64_t total = 0;
+  for (i = 0; i < SHM_CACHE_SLOTS; ++i) {
+    shm_cache_slot *s = &shm_index->slots[i];
+    uint32_t kind = state_kind(LOAD(&s->state));
+    if (kind == SLOT_READY || kind == SLOT_WRITING) total += LOAD(&s->bytes);
+  }
+  return total;
+}
+
+static gboolean is_key(const shm_cache_slot *s, const struct stat *st, uint32_t scale) {
+  return s->dev == (uint64_t)st->st_dev && s->ino == (uint64_t)st->st_ino &&
+         s->mtime == (uint64_t)st->st_mtime && s->size == (uint64_t)st->st_size &&
+         s->scale == scale;
+}
+
+/* Returns a new Imlib2 image with the pixels of the file with stat st
+ * published by any qiv process, or NULL.
+ */
+Imlib_Image shm_cache_get(const struct stat *st)
+{
+  unsigned i;
+  if (!shm_index) return NULL;
+  for (i = 0; i < SHM_CACHE_SLOTS; ++i) {
+    shm_cache_slot *s = &shm_index->slots[i];
+    uint64_t generation;
+    uint32_t w, h, has_alpha;
+    size_t bytes;
+    char name[96];
+    int fd;
+    void *p;
+    struct stat fst;
+    Imlib_Image im;
+    DATA32 *pixels;
+
+    if (LOAD(&s->state) != SLOT_READY) continue;
+    generation = LOAD(&s->generation);
+    if (!is_key(s, st, 1)) continue;
+    w = s->w;
+    h = s->h;
+    has_alpha = s->has_alpha;
+    /* The fields above are valid only if the slot wasn't reused meanwhile. */
+    if (LOAD(&s->state) != SLOT_READY || LOAD(&s->generation) != generation) continue;
+    bytes = (size_t)w * h * sizeof(DATA32);
+    slot_filename(name, sizeof name, i, generation);
+    if ((fd = open(name, O_RDONLY)) < 0) continue;  /* Just evicted. */
+    if (fstat(fd, &fst) != 0 || (size_t)fst.st_size != bytes ||
+        (p = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+      close(fd);
+      continue;
+    }
+    close(fd);
+    if ((im = imlib_create_image(w, h)) != NULL) {
+      imlib_context_set_image(im);
+      pixels = imlib_image_get_data();
+      memcpy(pixels, p, bytes);
+      imlib_image_put_back_data(pixels);
+      imlib_image_set_has_alpha(has_alpha);
+      STORE(&s->last_used, tick());
+    }
+    munmap(p, bytes);
+    if (im) {
+      ++shm_hits;
+      return im;
+    }
+  }
+  ++shm_misses;
+  return NULL;
+}
+
+/* Publishes the pixels of im, the full-size decode of the file with stat
+ * st, to the other qiv processes.
+ */
+void shm_cache_put(const struct stat *st, Imlib_Image im)
+{
+  const uint64_t budget = (uint64_t)shm_cache_mb << 20;
+  const uint32_t writing = owned_state(SLOT_WRITING);
+  Imlib_Image old_im = imlib_context_get_image();
+  uint64_t bytes, generation;
+  const char *data;
+  shm_cache_slot *s = NULL;
+  unsigned i, tries;
+  char name[96];
+  int fd;
+  size_t done;
+  ssize_t got;
+
+  if (!shm_index) return;
+  imlib_context_set_image(im);
+  bytes = (uint64_t)imlib_image_get_width() * imlib_image_get_height() * sizeof(DATA32);
+  if (bytes > budget) goto done;
+  for (i = 0; i < SHM_CACHE_SLOTS; ++i) {
+    uint32_t kind = state_kind(LOAD(&shm_index->slots[i].state));
+    if ((kind == SLOT_READY || kind == SLOT_WRITING) &&
+        is_key(&shm_index->slots[i], st, 1)) goto done;  /* Already there. */
+    if (kind == SLOT_WRITING || kind == SLOT_EVICTING) reclaim_slot(i);
+  }
+  for (tries = 0; used_bytes() + bytes > budget && tries < SHM_CACHE_SLOTS; ++tries) {
+    if (!evict_one()) break;
+  }
+  for (tries = 0; !s && tries < 2; ++tries) {
+    for (i = 0; i < SHM_CACHE_SLOTS; ++i) {
+      if (CAS(&shm_index->slots[i].state, SLOT_FREE, writing)) {
+        s = &shm_index->slots[i];
+        break;
+      }
+    }
+    if (!s && !evict_one()) break;
+  }
+  if (!s) goto done;
+  generation = __atomic_add_fetch(&shm_index->next_generation, 1, __ATOMIC_ACQ_REL);
+  STORE(&s->generation, generation);
+  s->dev = st->st_dev;
+  s->ino = st->st_ino;
+  s->mtime = st->st_mtime;
+  s->size = st->st_size;
+  s->scale = 1;
+  s->w = imlib_image_get_width();
+  s->h = imlib_image_get_height();
+  s->has_alpha = imlib_image_has_alpha();
+  STORE(&s->bytes, bytes);
+  STORE(&s->last_used, tick());
+  slot_filename(name, sizeof name, i, generation);
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
+    CAS(&s->state, writing, SLOT_FREE);
+    goto done;
+  }
+  data = (const char*)imlib_image_get_data_for_reading_only();
+  for (done = 0; done < bytes; done += got) {
+    if ((got = write(fd, data + done, bytes - done)) <= 0) {
+      if (got < 0 && errno == EINTR) { got = 0; continue; }
+      break;
+    }
+  }
+  close(fd);
+  if (done != bytes) {  /* For example, /dev/shm is full. */
+    unlink(name);
+    CAS(&s->state, writing, SLOT_FREE);
+    goto done;
+  }
+  if (!CAS(&s->state, writing, SLOT_READY)) {
+    unlink(name);  /* Not ours anymore (our pid was taken as dead). */
+    goto done;
+  }
+  ++shm_puts;
+ done:
+  imlib_context_set_image(old_im);
+}
+
+void shm_cache_print_stats(void)
+{
+  if (!shm_index) return;
+  g_print("shm_cache: %lu hits, %lu misses, %lu puts, %lu evictions, "
+          "%lu reclaimed, %.1f MiB used by all processes\n",
+          shm_hits, shm_misses, shm_puts, shm_evictions, shm_reclaims,
+          used_bytes() / 1048576.0);
+}
@@ -0,0 +1,154 @@
+/*
+  Module       : sniff.c
+  Purpose      : Recognize image files by their first bytes
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "qiv.h"
+
+/* Only the formats compiled in (EXTN_...) are recognized, by the
+ * signature in the first SNIFF_HEADER_SIZE bytes of the file. The first
+ * byte selects the only format which may match (formats_by_first_byte),
+ * so a file is compared against at most one signature, and against the
+ * TGA header checks if no signature starts with its first byte (TGA files
+ * have no signature).
+ */
+
+#define SNIFF_HEADER_SIZE 32
+
+enum {
+  SNIFF_NONE,
+  SNIFF_JPEG,
+  SNIFF_PNG,
+  SNIFF_GIF,
+  SNIFF_TIFF,
+  SNIFF_BMP,
+  SNIFF_PNM,
+  SNIFF_XPM,
+  SNIFF_PCX,
+  SNIFF_WEBP
+};
+
+static const unsigned char formats_by_first_byte[256] = {
+#ifdef EXTN_JPEG
+  [0xff] = SNIFF_JPEG,
+#endif
+#ifdef EXTN_PNG
+  [0x89] = SNIFF_PNG,
+#endif
+#ifdef EXTN_GIF
+  ['G'] = SNIFF_GIF,
+#endif
+#ifdef EXTN_TIFF
+  ['I'] = SNIFF_TIFF, ['M'] = SNIFF_TIFF,
+#endif
+#ifdef EXTN_BMP
+  ['B'] = SNIFF_BMP,
+#endif
+#if defined(EXTN_PPM) || defined(EXTN_PNM) || defined(EXTN_PGM)
+  ['P'] = SNIFF_PNM,
+#endif
+#ifdef EXTN_XPM
+  ['/'] = SNIFF_XPM, ['!'] = SNIFF_XPM,
+#endif
+#ifdef EXTN_PCX
+  [0x0a] = SNIFF_PCX,
+#endif
+#ifdef EXTN_WEBP
+  ['R'] = SNIFF_WEBP,
+#endif
+};
+
+static unsigned get_le16(const unsigned char *p) {
+  return p[0] | p[1] << 8;
+}
+
+static gboolean has_prefix(const unsigned char *h, size_t len, const char *prefix, size_t prefix_len) {
+  return len >= prefix_len && 0 == memcmp(h, prefix, prefix_len);
+}
+
+static gboolean is_bmp(const unsigned char *h, size_t len) {
+  unsigned dib_size;
+  if (len < 18 || h[1] != 'M') return FALSE;
+  dib_size = get_le16(h + 14) | get_le16(h + 16) << 16;
+  return dib_size == 12 || dib_size == 40 || dib_size == 52 ||
+      dib_size == 56 || dib_size == 64 || dib_size == 108 || dib_size == 124;
+}
+
+static gboolean is_pnm(const unsigned char *h, size_t len) {
+  if (len < 3 || h[1] < '1' || h[1] > '6') return FALSE;
+  return h[2] == ' ' || h[2] == '\t' || h[2] == '\n' || h[2] == '\r' || h[2] == '#';
+}
+
+static gboolean is_pcx(const unsigned char *h, size_t len) {
+  /* Version, encoding (RLE), bits per pixel. */
+  return len >= 4 && h[1] <= 5 && h[1] != 1 && h[2] == 1 &&
+      (h[3] == 1 || h[3] == 2 || h[3] == 4 || h[3] == 8);
+}
+
+#ifdef EXTN_TGA
+/* TGA files have no signature, so this checks that the header fields are
+ * consistent.
+ */
+static gboolean is_tga(const unsigned char *h, size_t len) {
+  unsigned type, cmap_type, depth;
+  if (len < 18) return FALSE;
+  cmap_type = h[1];
+  type = h[2] & ~8u;  /* RLE or not. */
+  depth = h[16];
+  if (cmap_type > 1 || type < 1 || type > 3 || (h[2] & ~11u)) return FALSE;
+  if ((type == 1) != (cmap_type == 1)) return FALSE;
+  if (cmap_type == 0 && (get_le16(h + 5) || h[7])) return FALSE;
+  if (get_le16(h + 12) == 0 || get_le16(h + 14) == 0) return FALSE;
+  return depth == 8 || depth == 15 || depth == 16 || depth == 24 || depth == 32;
+}
+#endif
+
+/* Returns TRUE if the first len bytes of a file (at most
+ * SNIFF_HEADER_SIZE) look like an image of a format compiled in.
+ */
+gboolean sniff_image_header(const unsigned char *h, size_t len)
+{
+  if (!len) return FALSE;
+  switch (formats_by_first_byte[h[0]]) {
+   case SNIFF_JPEG: return has_prefix(h, len, "\xff\xd8\xff", 3);
+   case SNIFF_PNG: return has_prefix(h, len, "\x89PNG\r\n\x1a\n", 8);
+   case SNIFF_GIF: return has_prefix(h, len, "GIF87a", 6) || has_prefix(h, len, "GIF89a", 6);
+   case SNIFF_TIFF: return has_prefix(h, len, "II*\0", 4) || has_prefix(h, len, "MM\0*", 4);
+   case SNIFF_BMP: return is_bmp(h, len);
+   case SNIFF_PNM: return is_pnm(h, len);
+   case SNIFF_XPM: return has_prefix(h, len, "/* XPM */", 9) || has_prefix(h, len, "! XPM2", 6);
+   case SNIFF_PCX: return is_pcx(h, len);
+   case SNIFF_WEBP:
+    return has_prefix(h, len, "RIFF", 4) && len >= 12 && 0 == memcmp(h + 8, "WEBP", 4);
+  }
+#ifdef EXTN_TGA
+  return is_tga(h, len);
+#else
+  return FALSE;
+#endif
+}
+
+/* Returns 1 if the file name looks like an image, 0 if not, -1 if it
+ * can't be read. Can be called by any thread.
+ */
+int sniff_image_file(const char *name)
+{
+  unsigned char h[SNIFF_HEADER_SIZE];
+  ssize_t got;
+  int fd = open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);  /* A FIFO would block. */
+  if (fd < 0) return -1;
+  do {
+    got = read(fd, h, sizeof h);
+  } while (got < 0 && errno == EINTR);
+  close(fd);
+  if (got < 0) return -1;
+  return sniff_image_header(h, got);
+}
@@ -0,0 +1,130 @@
+/*
+  Module       : sniffbench.c
+  Purpose      : Compare sniff_image_file() with libmagic
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+/* Not part of qiv. Classifies the files named on stdin (one per line) with
+ * sniff_image_file(), then with magic_file() as qiv did before sniff.c, and
+ * prints the time each took and the files they disagree on. Needs
+ * libmagic-dev:
+ *
+ *   make sniffbench
+ *   find /usr/share -type f | ./sniffbench
+ *
+ * Run it twice, so the page cache is warm for both.
+ */
+
+#include <magic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+static const char *image_magic[] = {
+#ifdef EXTN_JPEG
+  "JPEG image data",
+#endif
+#ifdef EXTN_GIF
+  "GIF image data",
+#endif
+#ifdef EXTN_TIFF
+  "TIFF image data",
+#endif
+#ifdef EXTN_XPM
+  "X pixmap image",
+#endif
+#ifdef EXTN_PNG
+  "PNG image data",
+#endif
+#ifdef EXTN_PGM
+  "Netpbm PBM",
+  "Netpbm PPM",
+#endif
+#ifdef EXTN_BMP
+  "PC bitmap data",
+#endif
+#ifdef EXTN_TGA
+  "Targa image data",
+#endif
+#ifdef EXTN_WEBP
+  "RIFF (little-endian) data, Web/P image",
+#endif
+ NULL
+};
+
+static int check_magic(magic_t cookie, const char *name) {
+  const char *description = magic_file(cookie, name);
+  int i;
+  if (!description) return 0;
+  for (i = 0; image_magic[i]; i++) {
+    if (strncasecmp(description, image_magic[i], strlen(image_magic[i])) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static double get_secs(void) {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1.0e6;
+}
+
+int main(void)
+{
+  char line[4096], **names = NULL;
+  char *sniffed;
+  size_t len;
+  int count = 0, cap = 0, i, sniff_count = 0, magic_count = 0;
+  double start, sniff_secs, magic_secs;
+  magic_t cookie;
+
+  while (fgets(line, sizeof line, stdin)) {
+    len = strlen(line);
+    if (len && line[len - 1] == '\n') line[--len] = '\0';
+    if (!len) continue;
+    if (count == cap) {
+      cap = cap ? cap * 2 : 1024;
+      names = (char**)xrealloc(names, cap * sizeof *names);
+    }
+    names[count++] = strdup(line);
+  }
+  if (!count) {
+    fprintf(stderr, "usage: find DIR -type f | sniffbench\n");
+    return 2;
+  }
+  sniffed = (char*)xmalloc(count);
+
+  start = get_secs();
+  for (i = 0; i < count; ++i) {
+    sniffed[i] = sniff_image_file(names[i]) == 1;
+    sniff_count += sniffed[i];
+  }
+  sniff_secs = get_secs() - start;
+
+  if ((cookie = magic_open(MAGIC_NONE)) == NULL || magic_load(cookie, NULL) != 0) {
+    fprintf(stderr, "sniffbench: cannot load the magic database\n");
+    return 1;
+  }
+  start = get_secs();
+  for (i = 0; i < count; ++i) {
+    int is_image = check_magic(cookie, names[i]);
+    magic_count += is_image;
+    if (is_image != sniffed[i])
+      printf("%s: %s\n", is_image ? "magic only" : "sniff only", names[i]);
+  }
+  magic_secs = get_secs() - start;
+  magic_close(cookie);
+
+  printf("%d files\n", count);
+  printf("sniff_image_file: %d images in %.3fs (%.1f us/file)\n",
+         sniff_count, sniff_secs, sniff_secs * 1.0e6 / count);
+  printf("magic_file:       %d images in %.3fs (%.1f us/file)\n",
+         magic_count, magic_secs, magic_secs * 1.0e6 / count);
+  return 0;
+}
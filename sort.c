@@ -0,0 +1,420 @@
+/*
+  Module       : sort.c
+  Purpose      : Sort the image file names
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* my_strcmp() finds the suffix (and with -P the basename) of both names
+ * for each comparison. sort_names() finds them once per name instead, and
+ * (except with -N) sorts 64-bit keys made of 7 characters each: first by
+ * the first 7 characters, then each run of equal keys by the next 7, and so
+ * on, so each character is read only a few times. Long runs are sorted by
+ * radix sort, short ones by qsort() with integer comparisons. Long lists
+ * are sorted in slices by several threads, then the slices are merged
+ * pairwise (also in parallel).
+ */
+
+#define SORT_KEY_CHARS 7
+#define SORT_SYMBOL_BITS 9
+/* Runs shorter than this are sorted with qsort() instead of a radix sort. */
+#define SORT_MIN_RADIX 65536
+/* Lists shorter than this are sorted by the calling thread. */
+#define SORT_MIN_PER_THREAD 32768
+#define SORT_MAX_THREADS 16
+
+typedef struct {
+    guint64 key;  /* Of the characters being sorted by, see key_at(). */
+    char *name;
+    unsigned start_off, suf_off;  /* Of the comparison start and suffix. */
+} qiv_sort_entry;
+
+typedef struct {
+    qiv_sort_entry *src, *dst;
+    size_t lo, mid, hi;
+} qiv_sort_task;
+
+/* This array makes it easy to sort filenames into merged-case order
+ * (e.g. AaBbCcDdEeFf...). */
+static unsigned char casemap[256] = {
+    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,
+    0x08,0x09,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,
+    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,
+    0x18,0x19,0x1A,0x1B,0x1C,0x1D,0x1E,0x1F,
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,
+    0x28,0x29,0x2A,0x2B,0x2C,0x2D,0x2E,0x2F,
+    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,
+    0x38,0x39,0x3A,0x3B,0x3C,0x3D,0x3E,0x3F,
+    0x40,0x41,0x43,0x45,0x47,0x49,0x4B,0x4D, /* @ABCDEFG */
+    0x4F,0x51,0x53,0x55,0x57,0x59,0x5B,0x5D, /* HIJKLMNO */
+    0x5F,0x61,0x63,0x65,0x67,0x69,0x6B,0x6D, /* PQRSTUVW */
+    0x6F,0x71,0x73,0x75,0x76,0x77,0x78,0x79, /* XYZ[\]^_ */
+    0x7A,0x42,0x44,0x46,0x48,0x4A,0x4C,0x4E, /* `abcdefg */
+    0x50,0x52,0x54,0x56,0x58,0x5A,0x5C,0x5E, /* hijklmno */
+    0x60,0x62,0x64,0x66,0x68,0x6A,0x6C,0x6E, /* pqrstuvw */
+    0x70,0x72,0x74,0x7B,0x7C,0x7D,0x7E,0x7F, /* xyz{|}~  */
+    0x80,0x81,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8A,0x8B,0x8C,0x8D,0x8E,0x8F,
+    0x90,0x91,0x92,0x93,0x94,0x95,0x96,0x97,
+    0x98,0x99,0x9A,0x9B,0x9C,0x9D,0x9E,0x9F,
+    0xA0,0xA1,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,
+    0xA8,0xA9,0xAA,0xAB,0xAC,0xAD,0xAE,0xAF,
+    0xB0,0xB1,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,
+    0xB8,0xB9,0xBA,0xBB,0xBC,0xBD,0xBE,0xBF,
+    0xC0,0xC1,0xC2,0xC3,0xC4,0xC5,0xC6,0xC7,
+    0xC8,0xC9,0xCA,0xCB,0xCC,0xCD,0xCE,0xCF,
+    0xD0,0xD1,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,
+    0xD8,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,0xDF,
+    0xE0,0xE1,0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,
+    0xE8,0xE9,0xEA,0xEB,0xEC,0xED,0xEE,0xEF,
+    0xF0,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,
+    0xF8,0xF9,0xFA,0xFB,0xFC,0xFD,0xFE,0xFF
+};
+
+/* Returns the start of the suffix of name (its last '.', or name itself
+ * if there is none), and sets *start_out to where the comparison starts.
+ */
+static unsigned char *find_suffix(unsigned char *name, unsigned char **start_out)
+{
+    unsigned char *sufptr = name + strlen((char *)name), *slash;
+
+    while (--sufptr > name && *sufptr != '.') {}
+    *start_out = name;
+    if (ignore_path_sort &&
+        (slash = (unsigned char *)strrchr((char *)name, '/')) != NULL)
+        *start_out = slash + 1;
+    return sufptr;
+}
+
+/* Compares two names from their starts cp1 and cp2, with their suffixes at
+ * sufptr1 and sufptr2 (see find_suffix()).
+ */
+static int compare_from(unsigned char *cp1, unsigned char *sufptr1,
+                        unsigned char *cp2, unsigned char *sufptr2)
+{
+    int tmp;
+
+    if (numeric_sort) {
+        int namelen = 0, diff = 0;
+
+        do {
+            if (sufptr1 && (isdigit(*cp1) || isdigit(*cp2))) {
+                unsigned char *ep1, *ep2;
+
+                if (diff)
+                    return diff;
+                for (ep1 = cp1; isdigit(*ep1); ep1++) {}
+                if (ep1 == cp1)
+                    return 1;
+                for (ep2 = cp2; isdigit(*ep2); ep2++) {}
+                if (cp2 == ep2)
+                    return -1;
+                if ((diff = (ep1 - cp1) - (ep2 - cp2)) == 0) {
+                    long val = atol((char *)cp1) - atol((char *)cp2);
+                    diff = val < 0? -1 : val > 0? 1 : 0;
+                }
+                if (diff && sufptr1 - cp1 <= namelen &&
+                    sufptr2 - cp2 <= namelen)
+                    return diff;
+                namelen += ep1 - cp1;
+                cp1 = ep1;
+                cp2 = ep2 - 1;
+            }
+            else {
+                if (cp1 == sufptr1) {
+                    if (cp2 != sufptr2)
+                        return -1;
+                    sufptr1 = sufptr2 = NULL;
+                }
+                else if (cp2 == sufptr2)
+                    return 1;
+                if (merged_case_sort)
+                    tmp = casemap[*cp1++] - casemap[*cp2];
+                else
+                    tmp = *cp1++ - *cp2;
+                if (tmp != 0)
+                    return tmp;
+                if (*cp2 == '/')
+                    namelen = 0;
+                else
+                    namelen++;
+            }
+        } while (*cp2++ != '\0');
+        return diff;
+    }
+
+    do {
+        if (cp1 == sufptr1) {
+            if (cp2 != sufptr2)
+                return -1;
+        }
+        else if (cp2 == sufptr2)
+            return 1;
+        if (merged_case_sort)
+            tmp = casemap[*cp1++] - casemap[*cp2];
+        else
+            tmp = *cp1++ - *cp2;
+        if (tmp != 0)
+            return tmp;
+    } while (*cp2++ != '\0');
+
+    return 0;
+}
+
+
+int my_strcmp(const void *v1, const void *v2)
+{
+    unsigned char *cp1, *cp2;
+    unsigned char *sufptr1 = find_suffix(*(unsigned char **)v1, &cp1);
+    unsigned char *sufptr2 = find_suffix(*(unsigned char **)v2, &cp2);
+
+    return compare_from(cp1, sufptr1, cp2, sufptr2);
+}
+
+/* Returns the key of the characters depth..depth+6 of the name of e
+ * (from its comparison start). Each character is a 9-bit symbol: 256 +
+ * casemap[c] (or 256 + c), or just casemap[c] at the suffix position,
+ * because there the name sorts before names which have no suffix there.
+ * So keys compare as compare_from() does without -N. The symbols after
+ * the terminating NUL (256) are 0.
+ */
+static guint64 key_at(const qiv_sort_entry *e, unsigned depth)
+{
+    unsigned char *name = (unsigned char *)e->name;
+    unsigned char *cp = name + e->start_off + depth, *sufptr = name + e->suf_off;
+    guint64 key = 0;
+    int i;
+
+    for (i = 0; i < SORT_KEY_CHARS; ++i) {
+        key = key << SORT_SYMBOL_BITS | (cp == sufptr ? 0 : 256) |
+              (merged_case_sort ? casemap[*cp] : *cp);
+        if (*cp++ == '\0')
+            return key << SORT_SYMBOL_BITS * (SORT_KEY_CHARS - 1 - i);
+    }
+    return key;
+}
+
+/* Returns TRUE if key includes the end of the name. */
+static gboolean is_key_end(guint64 key)
+{
+    int i;
+
+    for (i = 0; i < SORT_KEY_CHARS; ++i, key >>= SORT_SYMBOL_BITS) {
+        if ((key & ((1 << SORT_SYMBOL_BITS) - 1)) == 256)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static int compare_keys(const void *v1, const void *v2)
+{
+    const qiv_sort_entry *e1 = v1, *e2 = v2;
+
+    return e1->key < e2->key ? -1 : e1->key > e2->key;
+}
+
+static int compare_entries(const void *v1, const void *v2)
+{
+    const qiv_sort_entry *e1 = v1, *e2 = v2;
+    unsigned char *n1 = (unsigned char *)e1->name, *n2 = (unsigned char *)e2->name;
+
+    return compare_from(n1 + e1->start_off, n1 + e1->suf_off,
+                        n2 + e2->start_off, n2 + e2->suf_off);
+}
+
+/* Sorts entries[0..n) by their keys, 16 bits at a time from the lowest.
+ * Digits which are the same in all keys are skipped.
+ */
+static void radix_sort_keys(qiv_sort_entry *entries, size_t n)
+{
+    size_t (*counts)[65536] = xcalloc(4, sizeof *counts);
+    qiv_sort_entry *tmp = (qiv_sort_entry *)xmalloc(n * sizeof *tmp), *src = entries, *dst = tmp, *swap;
+    size_t i, sum, count;
+    int d, shift;
+
+    for (i = 0; i < n; ++i) {
+        for (d = 0; d < 4; ++d)
+            ++counts[d][entries[i].key >> 16 * d & 0xffff];
+    }
+    for (d = 0; d < 4; ++d) {
+        shift = 16 * d;
+        if (counts[d][src[0].key >> shift & 0xffff] == n)
+            continue;
+        for (i = sum = 0; i < 65536; ++i) {
+            count = counts[d][i];
+            counts[d][i] = sum;
+            sum += count;
+        }
+        for (i = 0; i < n; ++i)
+            dst[counts[d][src[i].key >> shift & 0xffff]++] = src[i];
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != entries)
+        memcpy(entries, src, n * sizeof *entries);
+    free(tmp);
+    free(counts);
+}
+
+/* Sorts entries[0..n) which are equal in their first depth characters, by
+ * the keys of the next characters, then each run of equal keys by the
+ * characters after them.
+ */
+static void sort_by_keys(qiv_sort_entry *entries, size_t n, unsigned depth)
+{
+    size_t i, j;
+
+    for (;;) {
+        if (n < 2)
+            return;
+        for (i = 0; i < n; ++i)
+            entries[i].key = key_at(&entries[i], depth);
+        for (i = 1; i < n && entries[i].key == entries[0].key; ++i) {}
+        if (i < n)
+            break;
+        if (is_key_end(entries[0].key))  /* All the same. */
+            return;
+        depth += SORT_KEY_CHARS;  /* E.g. a common directory. */
+    }
+    if (n >= SORT_MIN_RADIX)
+        radix_sort_keys(entries, n);
+    else
+        qsort(entries, n, sizeof *entries, compare_keys);
+    for (i = 0; i < n; i = j) {
+        for (j = i + 1; j < n && entries[j].key == entries[i].key; ++j) {}
+        if (j - i > 1 && !is_key_end(entries[i].key))
+            sort_by_keys(entries + i, j - i, depth + SORT_KEY_CHARS);
+    }
+}
+
+static void *sort_slice(void *arg)
+{
+    qiv_sort_task *t = arg;
+
+    if (numeric_sort)  /* The numeric order doesn't follow the characters. */
+        qsort(t->src + t->lo, t->hi - t->lo, sizeof *t->src, compare_entries);
+    else
+        sort_by_keys(t->src + t->lo, t->hi - t->lo, 0);
+    return NULL;
+}
+
+static void *merge_slices(void *arg)
+{
+    qiv_sort_task *t = arg;
+    size_t i = t->lo, j = t->mid, k = t->lo;
+
+    while (i < t->mid && j < t->hi)
+        t->dst[k++] = compare_entries(&t->src[j], &t->src[i]) < 0 ? t->src[j++] : t->src[i++];
+    while (i < t->mid)
+        t->dst[k++] = t->src[i++];
+    while (j < t->hi)
+        t->dst[k++] = t->src[j++];
+    return NULL;
+}
+
+/* Runs func for tasks[0..count), in threads but the first. */
+static void run_tasks(void *(*func)(void *), qiv_sort_task *tasks, int count)
+{
+    pthread_t threads[SORT_MAX_THREADS];
+    gboolean is_started[SORT_MAX_THREADS];
+    int i;
+
+    for (i = 1; i < count; ++i)
+        is_started[i] = pthread_create(&threads[i], NULL, func, &tasks[i]) == 0;
+    func(&tasks[0]);
+    for (i = 1; i < count; ++i) {
+        if (is_started[i])
+            pthread_join(threads[i], NULL);
+        else
+            func(&tasks[i]);
+    }
+}
+
+/* Sorts names[0..n) in the order of my_strcmp(). */
+void sort_names(char **names, size_t n)
+{
+    qiv_sort_entry *entries, *tmp;
+    qiv_sort_task tasks[SORT_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int slices = 1, width, i;
+    size_t k;
+
+    if (n < 2)
+        return;
+    while (slices * 2 <= SORT_MAX_THREADS && slices * 2 <= cpus &&
+           n / (slices * 2) >= SORT_MIN_PER_THREAD)
+        slices *= 2;
+    entries = (qiv_sort_entry *)xmalloc(n * sizeof *entries);
+    tmp = slices > 1 ? (qiv_sort_entry *)xmalloc(n * sizeof *tmp) : NULL;
+    for (k = 0; k < n; ++k) {
+        unsigned char *name = (unsigned char *)names[k], *start;
+        unsigned char *sufptr = find_suffix(name, &start);
+        entries[k].name = names[k];
+        entries[k].start_off = start - name;
+        entries[k].suf_off = sufptr - name;
+    }
+    for (i = 0; i < slices; ++i) {
+        tasks[i].src = entries;
+        tasks[i].lo = n * i / slices;
+        tasks[i].hi = n * (i + 1) / slices;
+    }
+    run_tasks(sort_slice, tasks, slices);
+    for (width = 1; width < slices; width *= 2) {
+        int count = 0;
+        for (i = 0; i < slices; i += 2 * width) {
+            tasks[count].src = entries;
+            tasks[count].dst = tmp;
+            tasks[count].lo = n * i / slices;
+            tasks[count].mid = n * (i + width) / slices;
+            tasks[count].hi = n * (i + 2 * width) / slices;
+            ++count;
+        }
+        run_tasks(merge_slices, tasks, count);
+        tmp = entries;
+        entries = tasks[0].dst;
+    }
+    for (k = 0; k < n; ++k)
+        names[k] = entries[k].name;
+    free(entries);
+    free(tmp);
+}
+
+/* Finds name in names[0..n), sorted by sort_names(). Returns its index, or
+ * -1 if it's not there, and sets *insert_idx_out to where it belongs.
+ */
+int find_sorted_name(char **names, int n, const char *name, int *insert_idx_out)
+{
+    int lo = 0, hi = n, mid, c, i;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((c = my_strcmp(&name, &names[mid])) == 0) {
+            lo = mid;
+            break;
+        } else if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    *insert_idx_out = lo;
+    /* Different names may compare equal, e.g. with -M or -P. */
+    for (i = lo; i < n && 0 == my_strcmp(&name, &names[i]); ++i) {
+        if (0 == strcmp(names[i], name)) return i;
+    }
+    for (i = lo - 1; i >= 0 && 0 == my_strcmp(&name, &names[i]); --i) {
+        if (0 == strcmp(names[i], name)) return i;
+    }
+    return -1;
+}
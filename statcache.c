@@ -0,0 +1,201 @@
+/*
+  Module       : statcache.c
+  Purpose      : Stat file lists in parallel, and keep the results
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* qiv -F list.txt and the file names on the command line are checked with
+ * stat() (is it a directory?) before the first image is displayed. On NFS
+ * or sshfs, each stat() is a round trip, so for long lists they are done by
+ * a pool of threads, keeping many requests in flight. (io_uring would
+ * not help here: the kernel runs IORING_OP_STATX in its own worker threads
+ * anyway.)
+ *
+ * The results are kept, so filter_images() can drop missing files without
+ * opening them to check their contents, and qiv_load_image() can use the result
+ * instead of calling stat() again. A result is used by qiv_load_image()
+ * only once, and only within STAT_CACHE_MAX_AGE seconds, later loads of the
+ * same file call stat() as before to notice changes.
+ */
+
+#define STAT_CACHE_MAX_THREADS 64
+/* Lists shorter than this are statted by the calling thread. */
+#define STAT_CACHE_NAMES_PER_THREAD 16
+#define STAT_CACHE_MAX_AGE 60
+
+/* The fields of struct stat used by qiv, smaller than a struct stat. */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  time_t statted_at;
+  mode_t mode;
+  int error;  /* errno of stat(), or 0. */
+} qiv_stat_entry;
+
+typedef struct {
+  char **names;
+  qiv_stat_entry *entries;
+  int count;
+  int next_idx;
+} qiv_stat_batch;
+
+/* Protects stat_entries: filter_images() and the background scan threads
+ * (is_image_name_accepted()) look up names while the main thread adds
+ * (streamed -F lists) and removes (image loads) entries.
+ */
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *stat_entries;  /* File name -> qiv_stat_entry*. */
+static unsigned long stat_count, stat_reused, stat_expired;
+static double stat_secs;
+static int stat_max_threads;
+
+static void *stat_worker(void *arg) {
+  qiv_stat_batch *batch = (qiv_stat_batch*)arg;
+  struct stat st;
+  qiv_stat_entry *e;
+  int i;
+  time_t now = time(NULL);
+  while ((i = __atomic_fetch_add(&batch->next_idx, 1, __ATOMIC_RELAXED)) < batch->count) {
+    e = &batch->entries[i];
+    e->statted_at = now;
+    if (stat(batch->names[i], &st) != 0) {
+      e->error = errno;
+      continue;
+    }
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->mode = st.st_mode;
+  }
+  return NULL;
+}
+
+/* Calls stat() for names[0..count), and keeps the results. The names must
+ * not be freed while they are in the cache (see stat_cache_forget()).
+ */
+void stat_cache_fill(char **names, int count)
+{
+  qiv_stat_batch batch;
+  pthread_t threads[STAT_CACHE_MAX_THREADS];
+  struct timeval before, after;
+  int thread_count = count / STAT_CACHE_NAMES_PER_THREAD, started, i;
+
+  if (count <= 0) return;
+  if (thread_count > STAT_CACHE_MAX_THREADS) thread_count = STAT_CACHE_MAX_THREADS;
+  if (thread_count < 1) thread_count = 1;
+  batch.names = names;
+  batch.count = count;
+  batch.next_idx = 0;
+  /* Never freed: entries stay in the cache until used or forgotten. */
+  batch.entries = (qiv_stat_entry*)xcalloc(count, sizeof *batch.entries);
+  gettimeofday(&before, 0);
+  /* The calling thread is one of the workers. */
+  for (started = 1; started < thread_count; ++started) {
+    if (pthread_create(&threads[started], NULL, stat_worker, &batch) != 0) break;
+  }
+  stat_worker(&batch);
+  for (i = 1; i < started; ++i) pthread_join(threads[i], NULL);
+  gettimeofday(&after, 0);
+  pthread_mutex_lock(&stat_lock);
+  if (!stat_entries) stat_entries = g_hash_table_new(g_str_hash, g_str_equal);
+  for (i = 0; i < count; ++i) {
+    g_hash_table_insert(stat_entries, names[i], &batch.entries[i]);
+  }
+  pthread_mutex_unlock(&stat_lock);
+  stat_count += count;
+  stat_secs += (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1.0e6;
+  if (started > stat_max_threads) stat_max_threads = started;
+}
+
+static void copy_entry(const qiv_stat_entry *e, struct stat *st) {
+  memset(st, 0, sizeof *st);
+  st->st_dev = e->dev;
+  st->st_ino = e->ino;
+  st->st_size = e->size;
+  st->st_mtime = e->mtime;
+  st->st_mode = e->mode;
+}
+
+/* Returns 1 (and fills st) if name was statted successfully by
+ * stat_cache_fill(), 0 if stat() failed, -1 if name is not in the cache.
+ * Can be called by any thread.
+ */
+int stat_cache_lookup(const char *name, struct stat *st)
+{
+  qiv_stat_entry *e;
+  int result = -1;
+  pthread_mutex_lock(&stat_lock);
+  if ((e = stat_entries ? g_hash_table_lookup(stat_entries, name) : NULL) != NULL) {
+    result = !e->error;
+    if (result) copy_entry(e, st);
+  }
+  pthread_mutex_unlock(&stat_lock);
+  return result;
+}
+
+/* The same as stat(), but answered from the cache if possible. If
+ * is_consumed, the result is removed from the cache, and used only if it is
+ * recent.
+ */
+int stat_cache_stat(const char *name, struct stat *st, gboolean is_consumed)
+{
+  qiv_stat_entry *e;
+  int error = 0;
+  pthread_mutex_lock(&stat_lock);
+  e = stat_entries ? g_hash_table_lookup(stat_entries, name) : NULL;
+  if (e && is_consumed) {
+    g_hash_table_remove(stat_entries, name);
+    if (time(NULL) - e->statted_at > STAT_CACHE_MAX_AGE) {
+      ++stat_expired;
+      e = NULL;
+    } else {
+      ++stat_reused;
+    }
+  }
+  if (e) {
+    error = e->error;
+    if (!error) copy_entry(e, st);
+  }
+  pthread_mutex_unlock(&stat_lock);
+  if (!e) return stat(name, st);
+  if (error) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/* Removes name from the cache, to be called before freeing it. */
+void stat_cache_forget(const char *name)
+{
+  pthread_mutex_lock(&stat_lock);
+  if (stat_entries) g_hash_table_remove(stat_entries, name);
+  pthread_mutex_unlock(&stat_lock);
+}
+
+void stat_cache_print_stats(void)
+{
+  if (!stat_count) return;
+  g_print("stat cache: %lu files statted in %.2fs (%.0f/s, %d threads), "
+          "%lu results reused by image loads, %lu expired\n",
+          stat_count, stat_secs, stat_secs > 0 ? stat_count / stat_secs : 0.0,
+          stat_max_threads, stat_reused, stat_expired);
+}
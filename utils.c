@@ -35,7 +35,6 @@ int move2trash()
 {
   char *ptr, *ptr2, *filename = image_names[image_idx];
   char trashfile[FILENAME_LEN], path_result[PATH_MAX];
-  int i;
 
   if (readonly)
     return 0;
@@ -101,10 +100,10 @@ int move2trash()
     del->trashfile = strdup(trashfile);
     del->pos = image_idx;
 
+    name_index_remove(image_idx);
     --images;
-    for(i=image_idx;i<images;++i) {
-      image_names[i] = image_names[i+1];
-    }
+    memmove(image_names + image_idx, image_names + image_idx + 1,
+            (images - image_idx) * sizeof *image_names);
 
     /* If deleting the last file out of x */
     if(images == image_idx)
@@ -213,7 +212,11 @@ int copy2select()
     strcpy(dstfile, dstfilebak);
   }
 
-  if (do_copy_link && 0 == link(filename1, dstfile)) return 0;
+  /* Link what a symlink (e.g. to a git-annex object) points to, not the
+   * symlink, which would be dangling in select_dir if relative.
+   */
+  if (do_copy_link &&
+      0 == linkat(AT_FDCWD, filename1, AT_FDCWD, dstfile, AT_SYMLINK_FOLLOW)) return 0;
   /* FYI There is a race condition between the stat(...) above and the open(...) below. */
   fdi = open(filename1, O_RDONLY);
   fdo = fdi >= 0 ? open(dstfile, O_CREAT | O_WRONLY | O_TRUNC, 0666) : -1;
@@ -245,7 +248,6 @@ int copy2select()
 /* move the last deleted image out of the delete list */
 int undelete_image()
 {
-  int i;
   qiv_deletedfile *del;
   char *ptr;
 
@@ -281,18 +283,60 @@ int undelete_image()
   }
   *ptr = '/';
 
-  image_idx = del->pos;
-  for(i=images;--i>=image_idx;) {
-    image_names[i+1] = image_names[i];
+  /* The list may have shrunk since (load errors, --watch_dirs). */
+  image_idx = MIN(del->pos, images);
+  if (images >= max_image_cnt) {
+    max_image_cnt += 8192;
+    image_names = (char**)xrealloc(image_names, max_image_cnt * sizeof *image_names);
   }
+  memmove(image_names + image_idx + 1, image_names + image_idx,
+          (images - image_idx) * sizeof *image_names);
   images++;
   image_names[image_idx] = del->filename;
+  name_index_add(image_idx);
   del->filename = NULL;
   free(del->trashfile);
 
   return 0;
 }
 
+/* To be called when a name is inserted to (delta 1) or removed from (delta
+ * -1) image_names at idx by something else than (un)deleting, so undelete
+ * puts files back where they were.
+ */
+void shift_deleted_files(int idx, int delta)
+{
+  int i;
+  if (!deleted_files) return;
+  for (i = 0; i < MAX_DELETE; ++i) {
+    if (deleted_files[i].filename && deleted_files[i].pos >= idx + (delta < 0))
+      deleted_files[i].pos += delta;
+  }
+}
+
+/* To be called when names are merged into image_names: inserted_at[0..count)
+ * are the indexes in the old image_names the names were inserted at, in
+ * ascending order.
+ */
+void remap_deleted_files(const int *inserted_at, int count)
+{
+  int i, lo, hi, mid;
+  if (!deleted_files) return;
+  for (i = 0; i < MAX_DELETE; ++i) {
+    if (!deleted_files[i].filename) continue;
+    lo = 0;  /* Count the names inserted at or before pos. */
+    hi = count;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (inserted_at[mid] <= deleted_files[i].pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    deleted_files[i].pos += lo;
+  }
+}
+
 static char ascii_toupper(char c) {
   return c - ((c - 'a' + 0U <= 'z' - 'a' + 0U) << 5);
 }
@@ -345,7 +389,7 @@ void run_command(qiv_image *q, const char *n, int tab_mode, char *filename, int
   static const char *lines[MAXLINES + 1];
   int pipe_stdout[2];
   int pid;
-  char *newfilename;
+  char *newfilename, *oldname;
   int i;
   struct stat before, after;
   char tab_mode_extra[2 + 3 * sizeof(int)];
@@ -441,7 +485,9 @@ void run_command(qiv_image *q, const char *n, int tab_mode, char *filename, int
     g_print("*** filename has changed from: '%s' to '%s'\n", image_names[image_idx], newfilename);
 #endif
 
+    oldname = image_names[image_idx];
     image_names[image_idx] = strdup(newfilename);
+    name_index_rename(image_idx, oldname);
     filename = strdup(newfilename);
 
     /* delete this line from the output */
@@ -482,6 +528,7 @@ void run_command(qiv_image *q, const char *n, int tab_mode, char *filename, int
    Enter jf10\n ... jumps 10 images forward
    Enter jb5\n  ... jumps 5 images backward
    Enter jt15\n ... jumps to image 15
+   Enter jnfoo/bar.jpg\n ... jumps to image foo/bar.jpg
 */
 void jump2image(char *cmd)
 {
@@ -496,11 +543,19 @@ void jump2image(char *cmd)
     direction = 1;
   else if(cmd[0] == 'b' || cmd[0] == 'B')
     direction = -1;
+  else if(cmd[0] == 'n' || cmd[0] == 'N') {
+    if ((x = name_index_find(cmd+1)) >= 0) {
+      prefetch_note_nav(NAV_JUMP, 0);
+      image_idx = x;
+    }
+    return;
+  }
   else if(!(cmd[0] == 't' || cmd[0] == 'T'))
     return;
 
   /* get number of images to jump or image to jump to */
   x = atoi(cmd+1);
+  prefetch_note_nav(NAV_JUMP, direction * x);
 
   if (direction == 1) {
     if ((image_idx + x) > (images-1))
@@ -532,6 +587,23 @@ void finish(int sig)
   (void)sig;
   gdk_pointer_ungrab(CurrentTime);
   gdk_keyboard_ungrab(CurrentTime);
+  if (do_print_stats) {
+    main_loop_print_stats();
+    scan_print_stats();
+    file_list_print_stats();
+    filter_print_stats();
+    name_index_print_stats();
+    stat_cache_print_stats();
+    prefetch_print_stats();
+    cache_print_stats();
+    shm_cache_print_stats();
+    render_cache_print_stats();
+    xdg_thumbnail_print_stats();
+    dircache_print_stats();
+    watch_print_stats();
+    meta_index_print_stats();
+  }
+  meta_index_save();
   exit(0);
 }
 
@@ -550,10 +622,12 @@ int set_image_direction(int direction) {
 */
 void next_image(int direction)
 {
+  int mode = !direction ? NAV_SLIDESHOW : abs(direction) > 1 ? NAV_PAGE : NAV_NEXT;
   if (!direction)
     direction = last_direction;
   else
     last_direction = direction >= 0 ? 1 : -1;
+  prefetch_note_nav(mode, direction);
   if (random_order)
     image_idx = get_random(random_replace, images, direction);
   else {
@@ -571,21 +645,8 @@ void next_image(int direction)
   is selected.
 */
 void next_image_dir(int direction) {
-  const int old_idx = image_idx;
-  const int delta = (direction < 0) ? -1 : 1;
-  const char *p = image_names[old_idx], *q = p + strlen(p);
-  while (p != q && q[-1] != '/') --q;
-  {
-    const size_t prefix_size = q - p;
-    for (;;) {
-      image_idx = (image_idx + delta) % images;
-      if (image_idx < 0) image_idx += images;
-      if (image_idx == old_idx) break;  /* Prevent infinite loop. TODO(pts): Report error or warning. */
-      /* fprintf(stderr, "info: trying image=(%s)\n", image_names[image_idx]); */
-      if (0 != strncmp(image_names[image_idx], p, prefix_size)) break;
-    }
-  }
-  /* fprintf(stderr, "info: using image=(%s)\n", image_names[image_idx]); */
+  prefetch_note_nav(NAV_DIR, direction);
+  image_idx = name_index_next_dir(image_idx, direction);
 }
 
 int checked_atoi (const char *s)
@@ -622,6 +683,7 @@ void show_help(char *name, int exit_status)
     g_print(
           "General options:\n"
           "    --file, -F x           Read list of file names from text file, stdin is -\n"
+          "    --null, -0             File names in --file lists are separated by NULs\n"
           "    --bg_color, -o x       Set root background color to x\n"
           "    --brightness, -b x     Set brightness to x (-32..32)\n"
           "    --browse, -B           Scan directory of file for browsing\n"
@@ -635,6 +697,14 @@ void show_help(char *name, int exit_status)
           "    --do_omit_load_stat    Don't call stat at image load, don't track changes\n"
           "    --do_tag_error_pos     Move the cursor to tag error reported by qiv-command\n"
           "    --do_copy_link         Create a hard link if possible when copying to .qiv-select\n"
+          "    --do_write_xdg_thumbnails Create missing thumbnails in ~/.cache/thumbnails\n"
+          "    --decoders x           Decode images in x helper processes (0: in qiv)\n"
+          "    --decoder_mem_limit x  Limit each decoder process to x MiB of memory\n"
+          "    --cache_mb x           Keep x MiB of LZ4-compressed decoded images in memory\n"
+          "    --shm_cache x          Share up to x MiB of decoded images with other qivs\n"
+          "    --no_render_cache      Don't cache shrunk images in ~/.cache/qiv\n"
+          "    --no_meta_index        Don't keep image sizes etc. in ~/.cache/qiv/metaindex\n"
+          "    --render_cache_mb x    Limit the size of ~/.cache/qiv to x MiB (default 512)\n"
           "    --disable_grab, -G     Disable pointer/kbd grab in fullscreen mode\n"
           "    --fixed_width, -w x    Window with fixed width x\n"
           "    --fixed_zoom, -W x     Window with fixed zoom factor (percentage x)\n"
@@ -646,15 +716,22 @@ void show_help(char *name, int exit_status)
           "    --maxpect, -m          Zoom to screen size and preserve aspect ratio\n"
           "    --merged_case_sort, -M Sort filenames with AaBbCc... alpha order\n"
           "    --no_filter, -n        Do not filter images by extension\n"
+          "    --lazy_filter          Check file contents only when shown\n"
           "    --no_statusbar, -i     Disable statusbar\n"
           "    --statusbar, -I        Enable statusbar\n"
+          "    --stats                Print cache and load statistics at exit\n"
           "    --no_sort, -D          Do not apply any sorting to the list of files\n"
           "    --numeric_sort, -N     Sort filenames with numbers intuitively\n"
           "    --root, -x             Set centered desktop background and exit\n"
           "    --root_t, -y           Set tiled desktop background and exit\n"
           "    --root_s, -z           Set stretched desktop background and exit\n"
           "    --scale_down, -t       Shrink image(s) larger than the screen to fit\n"
-          "    --thumbnail, -j        Show *.th.jpg instead of *.jpg in maxpect mode\n"
+          "    --thumbnail, -j        Show *.th.jpg (or ~/.cache/thumbnails) in maxpect mode\n"
+          "    --make_thumbnails      Create *.th.jpg for the images in the dirs, then exit\n"
+          "    --thumbnail_size x     Size of the *.th.jpg created (default 320)\n"
+          "    --index                Index the metadata of the images in the dirs, then exit\n"
+          "    --watch_dirs           Add and remove images as the directories change\n"
+          "    --follow               Like --watch_dirs, and show each new image\n"
           "    --transparency, -p     Enable transparency for transparent images\n"
           "    --watch, -T            Reload the image if it has changed on disk\n"
           "    --recursivedir, -u     Recursively include all files\n"
@@ -688,131 +765,6 @@ void show_help(char *name, int exit_status)
     gdk_exit(exit_status);
 }
 
-/* returns a random number from the integers 0..num-1, either with
-   replacement (replace=1) or without replacement (replace=0) */
-int get_random(int replace, int num, int direction)
-{
-  static int index = -1;
-  static int *rindices = NULL;  /* the array of random intgers */
-  static int rsize;
-
-  int n,m,p,q;
-
-  (void)replace; (void)direction;
-  if (!rindices)
-    rindices = (int *) xmalloc((unsigned) max_rand_num*sizeof(int));
-  if (rsize != num) {
-    rsize = num;
-    index = -1;
-  }
-
-  if (index < 0)         /* no more indices left in this cycle. Build a new */
-    {		         /* array of random numbers, by not sorting on random keys */
-      index = num-1;
-
-      for (m=0;m<num;m++)
-	{
-	  rindices[m] = m; /* Make an array of growing numbers */
-	}
-
-      for (n=0;n<num;n++)   /* simple insertion sort, fine for num small */
-	{
-	  p=(int)(((float)rand()/RAND_MAX) * (num-n)) + n ; /* n <= p < num */
-	  q=rindices[n];
-	  rindices[n]=rindices[p]; /* Switch the two numbers to make random order */
-	  rindices[p]=q;
-	}
-    }
-
-  return rindices[index--];
-}
-
-/* Recursively gets all files from a directory if <recursive> is true,
- * else just reads directory */
-int rreaddir(const char *dirname, int recursive)
-{
-  DIR *d;
-  struct dirent *entry;
-  char cdirname[FILENAME_LEN], name[FILENAME_LEN];
-  struct stat sb;
-  int before_count = images;
-
-  strncpy(cdirname, dirname, sizeof cdirname);
-  cdirname[FILENAME_LEN-1] = '\0';
-
-  if (!(d = opendir(cdirname)))
-    return -1;
-  while ((entry = readdir(d)) != NULL) {
-    if (strcmp(entry->d_name,".") == 0 ||
-        strcmp(entry->d_name,"..") == 0 ||
-        strcmp(entry->d_name,TRASH_DIR) == 0)
-      continue;
-    snprintf(name, sizeof name, "%s/%s", cdirname, entry->d_name);
-    if (stat(name, &sb) >= 0 && S_ISDIR(sb.st_mode)) {
-      if (!recursive)
-        continue;
-      rreaddir(name,1);
-    }
-    else {
-      if (images >= max_image_cnt) {
-        max_image_cnt += 8192;
-        if (!image_names)
-          image_names = (char**)xmalloc(max_image_cnt * sizeof(char*));
-        else
-          image_names = (char**)xrealloc(image_names,max_image_cnt*sizeof(char*));
-      }
-      image_names[images++] = strdup(name);
-    }
-  }
-  closedir(d);
-  return images - before_count;
-}
-
-/* Read image filenames from a file */
-int rreadfile(const char *filename)
-{
-	FILE *fp;
-	struct stat sb;
-	int before_count = images;
-
-         if (strcmp(filename,"-")) {
-                 fp = fopen(filename, "r");
-                 if(!fp) return -1;
-         } else
-                 fp = stdin;
-
-	if (!images) {
-		max_image_cnt = 8192;
-		image_names = (char**)xmalloc(max_image_cnt * sizeof(char*));
-	}
-
-	while (1) {
-		char line[ BUFSIZ ];
-		size_t linelen;
-
-		if (fgets(line, sizeof(line), fp) == NULL ) {
-			if (ferror(fp))
-				g_print("Error while reading %s: %s\n", filename, strerror(errno));
-			fclose(fp);
-			break;
-		}
-		linelen = strlen(line) -1;
-		if (line[linelen] == '\n') line[linelen--]  = '\0';
-		if (line[linelen] == '\r') line[linelen--]  = '\0';
-
-		if (!do_assume_files && stat(line, &sb) >= 0 && S_ISDIR(sb.st_mode))
-			rreaddir(line,1);
-		else {
-			if (images >= max_image_cnt) {
-				max_image_cnt <<= 1;
-				image_names = (char**)xrealloc(image_names,max_image_cnt*sizeof(char*));
-			}
-			image_names[images++] = strdup(line);
-		}
-	}
-    return images - before_count;
-}
-
 gboolean color_alloc(const char *name, GdkColor *color)
 {
     gboolean result;
@@ -848,34 +800,29 @@ int myround( double a )
   return( (a-(int)a > 0.5) ? (int)a+1 : (int)a);
 }
 
-/* File watcher, an idle thread checking whether the loaded file has changed */
-
-gboolean qiv_watch_file (gpointer data)
+/* Returns $XDG_CACHE_HOME/name (default: ~/.cache/name), creating the
+ * directories if needed, or NULL. The caller takes ownership.
+ */
+char *get_xdg_cache_dir(const char *name)
 {
-  struct stat statbuf;
-  qiv_image *q=data;
-  if(!watch_file)
-  	return FALSE;
-
-  if (current_mtime != 0 &&
-      stat(image_names[image_idx], &statbuf) == 0 &&
-      current_mtime != statbuf.st_mtime && statbuf.st_size) {
-	  reload_image(q);
-          update_image(q, REDRAW);
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home;
+  char *base, *dir;
+  if (xdg && xdg[0] == '/') {
+    base = g_strdup(xdg);
+  } else if ((home = getenv("HOME")) != NULL && home[0] != '\0') {
+    base = g_strdup_printf("%s/.cache", home);
+  } else {
+    return NULL;
   }
-  usleep(200);  /* avoid eating 100% cpu */
-
-  return TRUE;
-}
-
-int find_image(int images, char **image_names, char *name)
-{
-  int i;
-  for (i=0; i<images; i++) {
-    if (strcmp(name,image_names[i]) == 0)
-      return i;
+  mkdir(base, 0700);
+  dir = g_strdup_printf("%s/%s", base, name);
+  g_free(base);
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "qiv: cannot create %s: %s\n", dir, strerror(errno));
+    g_free(dir);
+    return NULL;
   }
-  return 0;
+  return dir;
 }
 
 #ifdef GTD_XINERAMA
@@ -0,0 +1,443 @@
+/*
+  Module       : watch.c
+  Purpose      : Reload the current image when it changes on disk (-T)
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+/* With --watch, qiv gets inotify events for the current file (following
+ * symlinks) and for its directory (editors often save to a temporary file
+ * and rename it over the original). Events are collected until none
+ * arrives for WATCH_DEBOUNCE_MS, so a program writing the file in several
+ * steps causes only one reload. Without inotify, the file is polled every
+ * WATCH_POLL_MS instead.
+ *
+ * With --watch_dirs, the directories read by rreaddir() are watched too:
+ * files written (closed after writing, or renamed) there are inserted to
+ * image_names in sort order, and deleted ones are removed. With --follow,
+ * qiv also jumps to the newest such image, e.g. for tethered shooting.
+ */
+
+#define WATCH_DEBOUNCE_MS 150
+#define WATCH_POLL_MS 500
+
+static guint debounce_source, poll_source;
+/* A close after writing or a rename happened, reload even if the mtime
+ * (with 1 second resolution) looks the same.
+ */
+static gboolean is_content_changed;
+static unsigned long watch_events, watch_reloads;
+
+static unsigned long dir_images_added, dir_images_removed;
+static unsigned long follow_count;
+static double follow_latency_sum, follow_latency_max;
+
+#ifdef HAVE_INOTIFY
+static int inotify_fd = -1;
+static gboolean is_inotify_failed;
+static qiv_image *watch_q;  /* Set when the main loop gets inotify events. */
+static int file_wd = -1, dir_wd = -1;
+static char *watched_name, *watched_dir;
+static const char *watched_basename;  /* Points into watched_name. */
+
+typedef struct {
+  char *name;  /* As passed to rreaddir(), without trailing '/'. */
+  gboolean is_recursive;
+} qiv_watched_dir;
+
+/* Protects watched_dirs, and opening inotify_fd: background scan threads
+ * add directories while the main loop handles events.
+ */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Watch descriptor -> qiv_watched_dir*, which are never freed. */
+static GHashTable *watched_dirs;
+static char *follow_name;  /* Newest image written, to be shown. */
+#endif
+
+static gboolean check_file_changed(gpointer data) {
+  qiv_image *q = data;
+  struct stat st;
+  debounce_source = 0;
+  if (!watch_file) return FALSE;
+  if (current_mtime != 0 &&
+      stat(image_names[image_idx], &st) == 0 && st.st_size &&
+      (is_content_changed || current_mtime != st.st_mtime)) {
+    ++watch_reloads;
+    reload_image(q);
+    update_image(q, REDRAW);
+  }
+  is_content_changed = FALSE;
+#ifdef HAVE_INOTIFY
+  if (inotify_fd >= 0 && file_wd >= 0) {
+    inotify_rm_watch(inotify_fd, file_wd);  /* The file may have been replaced. */
+    file_wd = -1;
+  }
+  watch_file_update(q);
+#endif
+  return FALSE;
+}
+
+static gboolean poll_file(gpointer data) {
+  if (!watch_file) {
+    poll_source = 0;
+    return FALSE;
+  }
+  check_file_changed(data);
+  return TRUE;
+}
+
+static void start_polling(qiv_image *q) {
+  if (!poll_source) poll_source = g_timeout_add(WATCH_POLL_MS, poll_file, q);
+}
+
+#ifdef HAVE_INOTIFY
+/* Removes the watch of the directory of the current file, unless it's
+ * also watched for --watch_dirs.
+ */
+static void remove_dir_wd(void) {
+  gboolean is_watched_dir;
+  if (dir_wd >= 0) {
+    pthread_mutex_lock(&watch_lock);
+    is_watched_dir = watched_dirs &&
+        g_hash_table_lookup(watched_dirs, GINT_TO_POINTER(dir_wd));
+    pthread_mutex_unlock(&watch_lock);
+    if (!is_watched_dir) inotify_rm_watch(inotify_fd, dir_wd);
+  }
+  dir_wd = -1;
+}
+
+static void remove_watches(void) {
+  if (file_wd >= 0) inotify_rm_watch(inotify_fd, file_wd);
+  remove_dir_wd();
+  file_wd = dir_wd = -1;
+  g_free(watched_name);
+  g_free(watched_dir);
+  watched_name = watched_dir = NULL;
+  watched_basename = NULL;
+}
+
+/* Returns the index of name in image_names, or -1. If image_names is
+ * sorted, *insert_idx_out is set to where name belongs.
+ */
+static int find_image_name(const char *name, int *insert_idx_out) {
+  if (!is_image_names_sorted) {
+    *insert_idx_out = images;
+    return name_index_find(name);
+  }
+  return find_sorted_name(image_names, images, name, insert_idx_out);
+}
+
+/* Adds name (owned by image_names from now) unless already there.
+ * Returns FALSE if not added.
+ */
+static gboolean add_image_name(char *name) {
+  int i;
+  if (!is_image_name_accepted(name) || find_image_name(name, &i) >= 0) return FALSE;
+  if (images >= max_image_cnt) {
+    max_image_cnt += 8192;
+    image_names = (char**)xrealloc(image_names, max_image_cnt*sizeof(char*));
+  }
+  memmove(image_names + i + 1, image_names + i, (images - i) * sizeof(char*));
+  image_names[i] = name;
+  ++images;
+  name_index_add(i);
+  shift_deleted_files(i, 1);
+  if (i <= image_idx && images > 1) ++image_idx;  /* Keep the current image. */
+  ++dir_images_added;
+  return TRUE;
+}
+
+static void remove_image_name(const char *name) {
+  int i, insert_idx;
+  /* Keep the last one, qiv needs at least one image. */
+  if (images <= 1 || (i = find_image_name(name, &insert_idx)) < 0) return;
+  name_index_remove(i);
+  memmove(image_names + i, image_names + i + 1, (images - i - 1) * sizeof(char*));
+  --images;
+  shift_deleted_files(i, -1);
+  ++dir_images_removed;
+  if (i < image_idx) {
+    --image_idx;
+  } else if (i == image_idx) {  /* Show the next one instead. */
+    if (image_idx >= images) image_idx = 0;
+    qiv_load_image(watch_q);
+  }
+}
+
+/* Adds a name read from a new directory. */
+static void add_new_dir_name(char *name) {
+  if (add_image_name(name) && follow) {
+    g_free(follow_name);
+    follow_name = g_strdup(name);
+  }
+}
+
+/* Handles files appearing in or disappearing from a --watch_dirs directory. */
+static void handle_dir_event(const qiv_watched_dir *wdir, const struct inotify_event *ev) {
+  char path[FILENAME_LEN], *name;
+
+  if (ev->mask & IN_ISDIR) {
+    if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && wdir->is_recursive &&
+        0 != strcmp(ev->name, TRASH_DIR)) {
+      /* Not from the pool, where rreaddir_each() allocates the names. */
+      g_snprintf(path, sizeof path, "%s/%s", wdir->name, ev->name);
+      rreaddir_each(path, 1, add_new_dir_name);
+    }
+    return;
+  }
+  name = xpool_path(wdir->name, ev->name);
+  if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+    if (add_image_name(name)) {
+      if (follow) {
+        g_free(follow_name);
+        follow_name = g_strdup(name);
+      }
+      return;  /* name is owned by image_names. */
+    }
+  } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+    remove_image_name(name);
+  }
+  xpool_free_last(name);
+}
+
+/* Jumps to follow_name, which has just been written. */
+static void show_follow_name(void) {
+  struct stat st;
+  struct timeval now;
+  double latency;
+  int i, insert_idx;
+  char *name = follow_name;
+
+  follow_name = NULL;
+  if ((i = find_image_name(name, &insert_idx)) >= 0) {
+    image_idx = i;
+    qiv_load_image(watch_q);
+    gdk_flush();
+    gettimeofday(&now, 0);
+    /* From the last write of the file to the display. */
+    if (stat(name, &st) == 0) {
+      latency = (now.tv_sec - st.st_mtim.tv_sec) * 1000.0 +
+                (now.tv_usec * 1000L - st.st_mtim.tv_nsec) / 1.0e6;
+      if (latency < 0) latency = 0;
+      ++follow_count;
+      follow_latency_sum += latency;
+      if (latency > follow_latency_max) follow_latency_max = latency;
+    }
+  }
+  g_free(name);
+}
+
+static gboolean handle_inotify(GIOChannel *source, GIOCondition condition, gpointer data) {
+  qiv_image *q = watch_q;
+  qiv_watched_dir *wdir;
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  ssize_t got;
+  char *p;
+  gboolean is_relevant = FALSE;
+  (void)source; (void)condition; (void)data;
+
+  while ((got = read(inotify_fd, buf, sizeof buf)) > 0) {
+    for (p = buf; p < buf + got; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event*)p;
+      ++watch_events;
+      /* The directory of the current file may be a --watch_dirs one. */
+      pthread_mutex_lock(&watch_lock);
+      wdir = watched_dirs ?
+          g_hash_table_lookup(watched_dirs, GINT_TO_POINTER(ev->wd)) : NULL;
+      if (wdir && (ev->mask & IN_IGNORED))
+        g_hash_table_remove(watched_dirs, GINT_TO_POINTER(ev->wd));
+      pthread_mutex_unlock(&watch_lock);
+      /* Unlocked, it may read a new directory, calling watch_dir_add(). */
+      if (wdir && !(ev->mask & IN_IGNORED) && ev->len)
+        handle_dir_event(wdir, ev);
+      if (ev->wd == file_wd) {
+        if (ev->mask & IN_IGNORED) file_wd = -1;  /* Deleted or replaced. */
+        if (ev->mask & IN_CLOSE_WRITE) is_content_changed = TRUE;
+        if (ev->mask & (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF))
+          is_relevant = TRUE;
+      } else if (ev->wd == dir_wd && ev->len && watched_basename &&
+                 0 == strcmp(ev->name, watched_basename)) {
+        if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) is_content_changed = TRUE;
+        is_relevant = TRUE;
+      } else if (ev->wd == dir_wd && (ev->mask & IN_IGNORED)) {
+        dir_wd = -1;
+      }
+    }
+  }
+  if (follow_name) show_follow_name();
+  if (is_relevant && watch_file) {
+    if (debounce_source) g_source_remove(debounce_source);
+    debounce_source = g_timeout_add(WATCH_DEBOUNCE_MS, check_file_changed, q);
+  }
+  return TRUE;
+}
+
+/* Called with watch_lock held. */
+static gboolean open_inotify(void) {
+  if (inotify_fd >= 0) return TRUE;
+  if (is_inotify_failed) return FALSE;
+  if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    fprintf(stderr, "qiv: inotify_init1: %s\n", strerror(errno));
+    is_inotify_failed = TRUE;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Starts receiving inotify events in the main loop. */
+static gboolean setup_inotify(qiv_image *q) {
+  GIOChannel *channel;
+  gboolean is_open;
+  pthread_mutex_lock(&watch_lock);
+  is_open = open_inotify();
+  pthread_mutex_unlock(&watch_lock);
+  if (!is_open) return FALSE;
+  if (!watch_q) {
+    watch_q = q;
+    channel = g_io_channel_unix_new(inotify_fd);
+    g_io_add_watch(channel, G_IO_IN, handle_inotify, NULL);
+    g_io_channel_unref(channel);
+  }
+  return TRUE;
+}
+#endif
+
+/* Called by rreaddir() before reading dirname, so that no file created
+ * during the read is missed. The events are processed after
+ * watch_dirs_start(). Can be called by any thread.
+ */
+void watch_dir_add(const char *dirname, int recursive)
+{
+#ifdef HAVE_INOTIFY
+  qiv_watched_dir *wdir;
+  size_t len = strlen(dirname);
+  int wd;
+
+  pthread_mutex_lock(&watch_lock);
+  if (!open_inotify()) goto done;
+  wd = inotify_add_watch(inotify_fd, dirname,
+                         IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                         IN_DELETE | IN_CREATE | IN_ONLYDIR | IN_MASK_ADD);
+  if (wd < 0) {
+    fprintf(stderr, "qiv: cannot watch %s: %s\n", dirname, strerror(errno));
+    goto done;
+  }
+  if (!watched_dirs) watched_dirs = g_hash_table_new(g_direct_hash, g_direct_equal);
+  if (g_hash_table_lookup(watched_dirs, GINT_TO_POINTER(wd))) goto done;
+  while (len > 1 && dirname[len - 1] == '/') --len;
+  wdir = (qiv_watched_dir*)xmalloc(sizeof *wdir);
+  wdir->name = g_strndup(dirname, len);
+  wdir->is_recursive = recursive;
+  g_hash_table_insert(watched_dirs, GINT_TO_POINTER(wd), wdir);
+ done:
+  pthread_mutex_unlock(&watch_lock);
+#else
+  (void)dirname; (void)recursive;
+#endif
+}
+
+/* Starts processing the events of the directories added by
+ * watch_dir_add().
+ */
+void watch_dirs_start(qiv_image *q)
+{
+#ifdef HAVE_INOTIFY
+  /* Even if none yet, background scans may still add some. */
+  if (watch_dirs) setup_inotify(q);
+#else
+  (void)q;
+  if (watch_dirs) fprintf(stderr, "qiv: --watch_dirs needs inotify\n");
+#endif
+}
+
+/* Starts watching image_names[image_idx] if watch_file is on, or moves the
+ * watch to it. Called whenever an image is loaded.
+ */
+void watch_file_update(qiv_image *q)
+{
+#ifdef HAVE_INOTIFY
+  const char *name, *slash;
+  char *dir;
+#endif
+
+  if (!watch_file) return;
+#ifdef HAVE_INOTIFY
+  if (poll_source || !setup_inotify(q)) {
+    start_polling(q);
+    return;
+  }
+  name = image_names[image_idx];
+  if (watched_name && 0 == strcmp(name, watched_name) && file_wd >= 0 && dir_wd >= 0)
+    return;
+  slash = strrchr(name, '/');
+  dir = slash ? g_strndup(name, slash == name ? 1 : slash - name) : g_strdup(".");
+  if (watched_dir && 0 == strcmp(dir, watched_dir) && dir_wd >= 0) {
+    g_free(dir);  /* Keep the directory watch. */
+  } else {
+    remove_dir_wd();
+    g_free(watched_dir);
+    watched_dir = dir;
+    /* IN_MASK_ADD keeps the events of a --watch_dirs watch of dir. */
+    dir_wd = inotify_add_watch(inotify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+                               IN_ATTRIB | IN_ONLYDIR | IN_MASK_ADD);
+  }
+  if (file_wd >= 0) inotify_rm_watch(inotify_fd, file_wd);
+  g_free(watched_name);
+  watched_name = g_strdup(name);
+  slash = strrchr(watched_name, '/');
+  watched_basename = slash ? slash + 1 : watched_name;
+  /* Follows symlinks, e.g. to git-annex objects. */
+  file_wd = inotify_add_watch(inotify_fd, name,
+                              IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  if (file_wd < 0 && errno == ENOSPC) {  /* fs.inotify.max_user_watches reached. */
+    remove_watches();
+    start_polling(q);
+  }
+#else
+  start_polling(q);
+#endif
+}
+
+/* Stops watching, after watch_file was turned off. */
+void watch_file_stop(void)
+{
+  if (debounce_source) g_source_remove(debounce_source);
+  if (poll_source) g_source_remove(poll_source);
+  debounce_source = poll_source = 0;
+  is_content_changed = FALSE;
+#ifdef HAVE_INOTIFY
+  if (inotify_fd >= 0) remove_watches();
+#endif
+}
+
+void watch_print_stats(void)
+{
+  if (!watch_events && !watch_reloads && !watch_dirs) return;
+  g_print("watch: %lu inotify events, %lu reloads\n", watch_events, watch_reloads);
+  if (watch_dirs) {
+    g_print("watch_dirs: %lu images added, %lu removed\n",
+            dir_images_added, dir_images_removed);
+  }
+  if (follow_count) {
+    g_print("follow: %lu new images shown, latency avg %.1f ms, max %.1f ms "
+            "(from the last write to the display)\n", follow_count,
+            follow_latency_sum / follow_count, follow_latency_max);
+  }
+}
@@ -0,0 +1,285 @@
+/*
+  Module       : xdgthumb.c
+  Purpose      : Read and write freedesktop.org thumbnails
+  More         : see qiv README
+  Policy       : GNU GPL
+  Homepage     : http://qiv.spiegl.de/
+  Original     : http://www.klografx.net/qiv/
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "qiv.h"
+#include "xmalloc.h"
+
+/* Desktop applications (file managers, image viewers) share thumbnails in
+ * $XDG_CACHE_HOME/thumbnails/{normal,large,x-large}/<md5 of URI>.png, as
+ * specified by the freedesktop.org Thumbnail Managing Standard. A thumbnail
+ * is valid if its Thumb::MTime PNG text chunk matches the mtime of the
+ * image file. With --thumbnail, qiv uses these when there is no *.th.jpg
+ * file, and with --do_write_xdg_thumbnails it creates the missing large
+ * ones from the images it has decoded anyway.
+ */
+
+#define XDG_LARGE_SIZE 256
+
+static char *thumbnails_dir;
+static gboolean is_thumbnails_dir_ok;
+static unsigned long xdg_hits, xdg_misses, xdg_stale, xdg_writes;
+
+/* Image to write the thumbnail of when idle. */
+static char *pending_uri;
+static char *pending_name;
+static time_t pending_mtime;
+static guint pending_source;
+
+static gboolean setup_thumbnails_dir(void) {
+  if (!thumbnails_dir) {
+    thumbnails_dir = get_xdg_cache_dir("thumbnails");
+    is_thumbnails_dir_ok = thumbnails_dir != NULL;
+    if (!thumbnails_dir) thumbnails_dir = g_strdup("");
+  }
+  return is_thumbnails_dir_ok;
+}
+
+/* Returns the file: URI of image_name, or NULL. */
+static char *get_uri(const char *image_name) {
+  char *abs_name = realpath(image_name, NULL);
+  char *uri;
+  if (!abs_name) return NULL;
+  uri = g_filename_to_uri(abs_name, NULL, NULL);
+  free(abs_name);
+  return uri;
+}
+
+static unsigned get_be32(const unsigned char *p) {
+  return (unsigned)p[0] << 24 | (unsigned)p[1] << 16 | (unsigned)p[2] << 8 | p[3];
+}
+
+static void set_be32(unsigned char *p, unsigned v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static const unsigned char png_signature[8] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+
+/* Returns TRUE if the PNG file thumbnail has a Thumb::MTime text chunk
+ * with value mtime. Reads only the chunks before the image data.
+ */
+static gboolean is_thumbnail_up_to_date(const char *thumbnail, time_t mtime) {
+  static const char key[] = "Thumb::MTime";
+  unsigned char head[8];
+  char text[256];
+  unsigned size;
+  gboolean result = FALSE;
+  FILE *f = fopen(thumbnail, "rb");
+  if (!f) return FALSE;
+  if (fread(head, 1, 8, f) != 8 || memcmp(head, png_signature, 8) != 0) goto done;
+  while (fread(head, 1, 8, f) == 8) {
+    size = get_be32(head);
+    if (0 == memcmp(head + 4, "IDAT", 4) || 0 == memcmp(head + 4, "IEND", 4)) break;
+    if (0 == memcmp(head + 4, "tEXt", 4) && size < sizeof(text)) {
+      if (fread(text, 1, size, f) != size) break;
+      text[size] = '\0';
+      if (0 == strcmp(text, key)) {  /* The value follows the '\0'. */
+        result = strtol(text + sizeof(key), NULL, 10) == (long)mtime;
+        break;
+      }
+      size = 0;
+    }
+    if (fseek(f, size + 4L, SEEK_CUR) != 0) break;  /* Skip data and CRC. */
+  }
+ done:
+  fclose(f);
+  return result;
+}
+
+static char *get_thumbnail_name(const char *uri, const char *size_dir) {
+  char *md5 = g_compute_checksum_for_string(G_CHECKSUM_MD5, uri, -1);
+  char *name = g_strdup_printf("%s/%s/%s.png", thumbnails_dir, size_dir, md5);
+  g_free(md5);
+  return name;
+}
+
+/* Returns the name of a valid freedesktop.org thumbnail of image_name
+ * (with stat st), the largest one first, or NULL. The caller takes
+ * ownership.
+ */
+char *xdg_thumbnail_filename(const char *image_name, const struct stat *st)
+{
+  static const char *const size_dirs[] = {"x-large", "large", "normal", NULL};
+  const char *const *size_dir;
+  char *uri, *name;
+  gboolean is_stale = FALSE;
+
+  if (!setup_thumbnails_dir()) return NULL;
+  if ((uri = get_uri(image_name)) == NULL) return NULL;
+  for (size_dir = size_dirs; *size_dir; ++size_dir) {
+    name = get_thumbnail_name(uri, *size_dir);
+    if (access(name, R_OK) == 0) {
+      if (is_thumbnail_up_to_date(name, st->st_mtime)) {
+        g_free(uri);
+        ++xdg_hits;
+        return name;
+      }
+      is_stale = TRUE;
+    }
+    g_free(name);
+  }
+  g_free(uri);
+  if (is_stale) ++xdg_stale; else ++xdg_misses;
+  return NULL;
+}
+
+static unsigned crc32_update(unsigned crc, const unsigned char *p, size_t size) {
+  static unsigned table[256];
+  unsigned i, j, c;
+  if (!table[1]) {
+    for (i = 0; i < 256; ++i) {
+      for (c = i, j = 0; j < 8; ++j) c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  for (; size > 0; --size, ++p) crc = table[(crc ^ *p) & 255] ^ (crc >> 8);
+  return crc;
+}
+
+static void write_text_chunk(FILE *f, const char *key, const char *value) {
+  size_t key_size = strlen(key) + 1, value_size = strlen(value);
+  unsigned char head[8], crc_buf[4];
+  unsigned crc;
+  set_be32(head, key_size + value_size);
+  memcpy(head + 4, "tEXt", 4);
+  crc = crc32_update(0xffffffffU, head + 4, 4);
+  crc = crc32_update(crc, (const unsigned char*)key, key_size);
+  crc = crc32_update(crc, (const unsigned char*)value, value_size);
+  set_be32(crc_buf, crc ^ 0xffffffffU);
+  fwrite(head, 1, 8, f);
+  fwrite(key, 1, key_size, f);
+  fwrite(value, 1, value_size, f);
+  fwrite(crc_buf, 1, 4, f);
+}
+
+/* Writes the large thumbnail of the image in the Imlib2 context. */
+static void write_thumbnail(const char *uri, time_t mtime) {
+  Imlib_Image orig_im = imlib_context_get_image();
+  Imlib_Image im;
+  gint w = imlib_image_get_width(), h = imlib_image_get_height();
+  gint th_w, th_h;
+  char old_anti_alias;
+  char *dir, *name, *tmp_name, *tmp2_name;
+  char value[32];
+  unsigned char *data = NULL;
+  long size = 0;
+  FILE *f;
+
+  if (w <= XDG_LARGE_SIZE && h <= XDG_LARGE_SIZE) return;  /* Not needed. */
+  name = get_thumbnail_name(uri, "large");
+  if (is_thumbnail_up_to_date(name, mtime)) {
+    g_free(name);
+    return;
+  }
+  if (w >= h) {
+    th_w = XDG_LARGE_SIZE;
+    th_h = MAX(1, (gint)((double)h * XDG_LARGE_SIZE / w + 0.5));
+  } else {
+    th_h = XDG_LARGE_SIZE;
+    th_w = MAX(1, (gint)((double)w * XDG_LARGE_SIZE / h + 0.5));
+  }
+  dir = g_strdup_printf("%s/large", thumbnails_dir);
+  mkdir(dir, 0700);
+  g_free(dir);
+  tmp_name = g_strdup_printf("%s.qiv%d", name, (int)getpid());
+  tmp2_name = g_strdup_printf("%s.qiv%dt", name, (int)getpid());
+
+  old_anti_alias = imlib_context_get_anti_alias();
+  imlib_context_set_anti_alias(1);
+  im = imlib_create_cropped_scaled_image(0, 0, w, h, th_w, th_h);
+  imlib_context_set_anti_alias(old_anti_alias);
+  if (!im) goto done;
+  imlib_context_set_image(im);
+  imlib_image_set_format("png");
+  imlib_save_image(tmp_name);
+  imlib_free_image();
+  imlib_context_set_image(orig_im);
+
+  /* Insert the required text chunks after IHDR (signature + 25 bytes). */
+  if ((f = fopen(tmp_name, "rb")) != NULL) {
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 33 &&
+        fseek(f, 0, SEEK_SET) == 0) {
+      data = xmalloc(size);
+      if (fread(data, 1, size, f) != (size_t)size ||
+          memcmp(data, png_signature, 8) != 0 ||
+          memcmp(data + 12, "IHDR", 4) != 0) {
+        free(data);
+        data = NULL;
+      }
+    }
+    fclose(f);
+  }
+  unlink(tmp_name);
+  if (!data || (f = fopen(tmp2_name, "wb")) == NULL) goto done;
+  fwrite(data, 1, 33, f);
+  write_text_chunk(f, "Thumb::URI", uri);
+  g_snprintf(value, sizeof value, "%ld", (long)mtime);
+  write_text_chunk(f, "Thumb::MTime", value);
+  g_snprintf(value, sizeof value, "%d", w);
+  write_text_chunk(f, "Thumb::Image::Width", value);
+  g_snprintf(value, sizeof value, "%d", h);
+  write_text_chunk(f, "Thumb::Image::Height", value);
+  write_text_chunk(f, "Software", "qiv");
+  fwrite(data + 33, 1, size - 33, f);
+  if (fclose(f) != 0 || chmod(tmp2_name, 0600) != 0 ||
+      rename(tmp2_name, name) != 0) {
+    unlink(tmp2_name);
+  } else {
+    ++xdg_writes;
+  }
+ done:
+  free(data);
+  g_free(name);
+  g_free(tmp_name);
+  g_free(tmp2_name);
+}
+
+static gboolean write_pending_thumbnail(gpointer data) {
+  qiv_image *q = data;
+  pending_source = 0;
+  /* Still showing the same, unmodified image? */
+  if (pending_name && q->is_cacheable && imlib_context_get_image() &&
+      0 == strcmp(pending_name, image_names[image_idx]) &&
+      current_mtime == pending_mtime) {
+    write_thumbnail(pending_uri, pending_mtime);
+  }
+  g_free(pending_uri);
+  g_free(pending_name);
+  pending_uri = pending_name = NULL;
+  return FALSE;
+}
+
+/* Writes a thumbnail for image_name (with stat st), which is displayed in
+ * q, when qiv is idle.
+ */
+void xdg_thumbnail_schedule(qiv_image *q, const char *image_name, const struct stat *st)
+{
+  char *uri;
+  if (!setup_thumbnails_dir() || strstr(image_name, "/thumbnails/")) return;
+  if ((uri = get_uri(image_name)) == NULL) return;
+  g_free(pending_uri);
+  g_free(pending_name);
+  pending_uri = uri;
+  pending_name = g_strdup(image_name);
+  pending_mtime = st->st_mtime;
+  if (!pending_source) {
+    pending_source = g_idle_add_full(G_PRIORITY_LOW, write_pending_thumbnail, q, NULL);
+  }
+}
+
+void xdg_thumbnail_print_stats(void)
+{
+  if (!is_thumbnails_dir_ok) return;
+  g_print("xdg_thumbnails: %lu found, %lu stale, %lu missing, %lu written\n",
+          xdg_hits, xdg_stale, xdg_misses, xdg_writes);
+}
@@ -10,3 +10,7 @@
 extern void *xmalloc(size_t size);
 extern void *xcalloc(size_t num, size_t size);
 extern void *xrealloc(void *ptr, size_t size);
+extern void *xpool_alloc(size_t size);
+extern char *xpool_strdup(const char *str);
+extern char *xpool_path(const char *dir, const char *name);
+extern void xpool_free_last(char *str);